@@ -17,16 +17,50 @@
 #include <string.h>
 #include <sys/syslimits.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include "blit.h"
+#include "capture.h"
 #include "utils.h"
 
 #define LEFT_LABEL_X CENTER(24)
 #define RIGHT_LABEL_X CENTER(0)
 #define printf ksceDebugPrintf
 
-static SceUID g_hooks[14];
+enum {
+	HOOK_DISPLAY,
+	HOOK_CTRL1, HOOK_CTRL2, HOOK_CTRL3, HOOK_CTRL4, HOOK_CTRL5, HOOK_CTRL6, HOOK_CTRL7, HOOK_CTRL8,
+	HOOK_PROCESS,
+	HOOK_POWER1, HOOK_POWER2, HOOK_POWER3, HOOK_POWER4,
+	HOOK_IO_READ, HOOK_IO_WRITE,
+	HOOK_COUNT
+};
+#define HOOK_TYPE_EXPORT 0
+#define HOOK_TYPE_IMPORT 1
+#define HOOK_TYPE_OFFSET 2
+
+#define HOOK_CORE        0 // always installed
+#define HOOK_INPUT       1 // always installed, bypassed per title through hooksOff
+#define HOOK_STATS       2 // installed the first time the statistics it feeds are enabled
+
+typedef struct hook_entry {
+	const char *name;
+	int type;
+	const char *module;
+	uint32_t library_nid;
+	uint32_t nid; // module offset for HOOK_TYPE_OFFSET
+	const void *handler;
+	tai_hook_ref_t *ref;
+	int kind;
+	int active; // HOOK_INPUT: handled for the focused title, otherwise passed straight through
+	SceUID uid;
+} hook_entry;
 
-static const char *ERRORS[5]={ 
+static hook_entry hooks[HOOK_COUNT];
+static uint32_t hook_hits[HOOK_COUNT], hook_title_hits[HOOK_COUNT], hook_mark[HOOK_COUNT];
+static int hooks_dirty = 0;
+void hooks_apply();
+
+static const char *ERRORS[7]={ 
 	#define NO_ERROR 0
 	"No error.", 
 	#define SAVE_ERROR 1
@@ -36,7 +70,11 @@ static const char *ERRORS[5]={
 	#define LOAD_ERROR 3
 	"There was a problem loading.", 
 	#define LOAD_GOOD 4
-	"Configuration loaded."
+	"Configuration loaded.",
+	#define CAPTURE_ERROR 5
+	"There was a problem starting capture.",
+	#define SESSION_GOOD 6
+	"Session restored."
 };
 
 int error_code = NO_ERROR;
@@ -49,6 +87,13 @@ typedef struct titleid_config {
 	int showBat;
 	int buttonSwap;
 	int showFPS;
+	int fpsCap;
+	int showMem;
+	int logging;
+	unsigned char remap[16]; // destination button bit + 1, 0 leaves the button alone
+	uint32_t hooksOff; // input hooks bypassed for this title, one bit per HOOK_*
+	int boost;
+	int ioStats;
 } titleid_config;
 
 static char config_path[PATH_MAX];
@@ -76,6 +121,148 @@ static int profile_max_performance[] = {444, 222, 222, 166, 333};
 static int profile_holy_shit_performance[] = {500, 222, 222, 166, 333};
 static int profile_max_battery[] = {111, 111, 111, 111, 111};
 static int* profiles[5] = {profile_default,profile_game,profile_max_performance, profile_holy_shit_performance, profile_max_battery};
+static const char *PROFILE_NAMES[5] = {"Default  ", "Game Def.", "Max Perf.", "Holy Shit.", "Max Batt."};
+// clocks the power hooks apply; the validator substitutes its own steps while it runs
+static int *validator_clocks = NULL;
+#define ACTIVE_PROFILE (validator_clocks ? validator_clocks : profiles[current_config.mode])
+
+#define VBLANK_RATE          60 // nominal, the panel runs at 59.94Hz
+static const int fps_caps[] = {0, 30, 20, 15};
+#define FPS_CAPS_COUNT (sizeof(fps_caps) / sizeof(fps_caps[0]))
+static int limit_vcount = 0;
+static void *flip_base = NULL; // last base submitted by the focused process and the vblank it left the hook in
+static uint32_t flip_vcount = 0;
+static uint64_t frame_last = 0, frame_count = 0, frame_sum = 0, frame_sumsq = 0, frame_window = 0;
+static int frame_avg = 0, frame_dev = 0;
+
+#define MEM_GROWTH_SAMPLES   10 // consecutive shrinking samples before we call it a leak
+static SceUID sampler_thid = -1, sampler_sema = -1;
+static int sampler_run = 0;
+static SceKernelFreeMemorySizeInfo mem_proc, mem_kern; // mem_kern: queried from the sampler, i.e. the kernel process
+static int mem_kern_ok = 0;
+static uint64_t mem_time = 0, mem_seen = 0;
+// the API only reports free memory, so used is measured per type against the most seen free
+#define MEM_USER             0
+#define MEM_CDRAM            1
+#define MEM_PHYCONT          2
+static uint32_t mem_peak_free[3], mem_last_free = 0;
+static int mem_growth = 0;
+
+#define LAT_BUCKETS          32
+#define LAT_BUCKET_US        8000 // half a frame at 60 FPS
+typedef struct latency_stats {
+	uint32_t count, sum, min, max; // microseconds
+	uint32_t hist[LAT_BUCKETS];
+} latency_stats;
+// Measurements not merged into latency.bin yet. The display hook fills lat_pending[lat_cur]
+// while the sampler thread swaps the index and merges the other one, no lock on the flip path.
+typedef struct latency_pending {
+	char titleid[32]; // who the measurements belong to, empty while there are none
+	latency_stats stats[5]; // one per clock profile
+} latency_pending;
+static latency_pending lat_pending[2];
+static volatile int lat_cur = 0, lat_writers = 0;
+static latency_stats lat_saved[5]; // the focused title's totals as of the last merge
+static int latencyMode = 0, lat_dirty = 0;
+static uint64_t lat_press = 0;
+static uint32_t lat_buttons = 0, lat_last_sig = 0, lat_base_sig = 0, lat_last_us = 0;
+
+#define OSD_BASES            4 // framebuffers of the focused title we remember drawing into
+typedef struct osd_buffer {
+	void *base;
+	uint32_t gen;
+	uint32_t vcount;
+} osd_buffer;
+static osd_buffer osd_bases[OSD_BASES];
+static int osd_next = 0;
+static uint32_t osd_key = 0, osd_gen = 0, osd_drawn = 0, osd_skipped = 0;
+
+// What a process was running with when it lost focus, so coming back to it
+// does not need the memory card
+#define SESSION_COUNT 4
+typedef struct session_state {
+	SceUID pid;
+	uint64_t time;
+	char titleid[32];
+	titleid_config config;
+	int clocks[5];
+	int fps, frame_avg, frame_dev;
+} session_state;
+static session_state sessions[SESSION_COUNT];
+static uint64_t resume_time = 0;
+static int resume_us = 0, resume_cached = 0;
+
+// Adrenaline's shared block (ADRENALINE_ADDRESS 0xABCDE000 on the PSP side), as mapped
+// into the emulator process: PSP RAM 0x08000000 sits at 0x70000000 there
+#define PSPEMU_ADRENALINE_ADDR 0x73CDE000
+typedef struct SceAdrenaline {
+	int savestate_mode;
+	int num;
+	unsigned int sp;
+	unsigned int ra;
+	int pops_mode;
+	int draw_psp_screen_in_pops;
+	char title[128];
+	char titleid[12];
+	char filename[256];
+	int psp_cmd;
+	int vita_cmd;
+	int vita_response;
+} SceAdrenaline;
+
+#define LAUNCH_BUCKETS       32 // one second each
+#define LAUNCH_CHANGED       16 // of the FRAME_SAMPLES pixels
+#define LAUNCH_TIMEOUT       (120 * TIMER_SECOND)
+typedef struct launch_stats {
+	uint32_t count;
+	uint32_t sum[3], min[3], max[3]; // title ID, first flip, first content; ms from process start
+	uint32_t hist[LAUNCH_BUCKETS];
+} launch_stats;
+static launch_stats launch_data[5]; // one per clock profile
+static SceUID launch_pid = 0;
+static uint64_t launch_start = 0;
+static uint32_t launch_resolve = 0, launch_flip = 0, launch_content = 0, launch_ref[64];
+static int launch_dirty = 0;
+static char launch_titleid[32];
+
+// Per core so the I/O hooks rarely share a cache line; updated atomically since a caller can be
+// preempted or migrate mid-update, no lock needed
+#define IO_READ              0
+#define IO_WRITE             1
+#define IO_BUCKETS           24 // log2 of the call time in microseconds
+typedef struct io_counters {
+	uint32_t ops[2];
+	uint64_t bytes[2];
+	uint32_t hist[2][IO_BUCKETS];
+} __attribute__((aligned(64))) io_counters;
+static io_counters io_cpu[4], io_last;
+static uint64_t io_last_time = 0;
+static int io_kbps[2], io_ops[2], io_p99[2];
+
+static const int capture_rates[] = {0, 1, 5, 10, 30};
+#define CAPTURE_RATES_COUNT (sizeof(capture_rates) / sizeof(capture_rates[0]))
+
+#define BOOST_THREADS        2
+#define BOOST_MAX_THREADS    64
+#define BOOST_INTERVAL       5 // samples between picking the heaviest threads again
+#define BOOST_PRIORITY_STEP  16
+#define BOOST_PRIORITY_MAX   64 // highest user priority
+static const int boost_masks[BOOST_THREADS] = {SCE_KERNEL_CPU_MASK_USER_0, SCE_KERNEL_CPU_MASK_USER_1};
+#define BOOST_OTHER_MASK     SCE_KERNEL_CPU_MASK_USER_2 // where the rest of the title runs while boosted
+typedef struct boosted_thread {
+	SceUID thid;
+	int priority, affinity; // what to put back
+} boosted_thread;
+static boosted_thread boosted[BOOST_MAX_THREADS]; // every thread of the title we changed
+static int boosted_count = 0;
+static SceUID boost_top[BOOST_THREADS];
+static SceUID boost_pid = 0, boost_thids[BOOST_MAX_THREADS];
+static uint64_t boost_run[BOOST_MAX_THREADS];
+static int boost_count = 0, boost_ticks = 0, boost_active = 0;
+static uint64_t boost_frame_sum[2];
+static uint32_t boost_frame_n[2];
+static int captureRate = 0;
+static uint64_t capture_last = 0;
 
 
 int (*_kscePowerGetGpuEs4ClockFrequency)(int*, int*);
@@ -85,8 +272,12 @@ int (*_kscePowerSetGpuClockFrequency)(int);
 int (*_ksceKernelGetModuleInfo)(SceUID, SceUID, SceKernelModuleInfo *);
 int (*_ksceKernelGetModuleList)(SceUID pid, int flags1, int flags2, SceUID *modids, size_t *num);
 int (*_ksceKernelExitProcess)(int);
+int (*_ksceKernelGetFreeMemorySize)(SceKernelFreeMemorySizeInfo *);
+int (*_ksceKernelGetThreadIdList)(SceUID pid, SceUID *ids, int n, int *copy_count);
 
 #define ksceKernelExitProcess _ksceKernelExitProcess
+#define ksceKernelGetFreeMemorySize _ksceKernelGetFreeMemorySize
+#define ksceKernelGetThreadIdList _ksceKernelGetThreadIdList
 #define ksceKernelGetModuleInfo _ksceKernelGetModuleInfo
 #define ksceKernelGetModuleList _ksceKernelGetModuleList
 #define kscePowerGetGpuEs4ClockFrequency _kscePowerGetGpuEs4ClockFrequency
@@ -94,11 +285,70 @@ int (*_ksceKernelExitProcess)(int);
 #define kscePowerGetGpuClockFrequency _kscePowerGetGpuClockFrequency
 #define kscePowerSetGpuClockFrequency _kscePowerSetGpuClockFrequency
 
+static const char *BUTTON_NAMES[16] = {
+	"SELECT", "L3", "R3", "START", "UP", "RIGHT", "DOWN", "LEFT",
+	"L2", "R2", "L1", "R1", "TRIANGLE", "CIRCLE", "CROSS", "SQUARE"
+};
+
+// One lookup per byte of the buttons word; each entry holds where those bits end up
+static uint32_t remap_table[4][256];
+static int remap_active = 0;
+#define REMAP_MAX_CYCLES     1000 // per sample; more means the loop was interrupted, not timed
+static uint64_t remap_cycles = 0, remap_samples = 0;
+
+void build_remap_table() {
+	uint32_t dest[32];
+	int i, b;
+	remap_active = 0;
+	for(i = 0; i < 32; i++)
+		dest[i] = 1 << i;
+	for(i = 0; i < 16; i++) {
+		if(current_config.remap[i] && current_config.remap[i] <= 16) {
+			dest[i] = 1 << (current_config.remap[i] - 1);
+			remap_active = 1;
+		}
+	}
+	if(current_config.buttonSwap) {
+		uint32_t circle = dest[13];
+		dest[13] = dest[14];
+		dest[14] = circle;
+		remap_active = 1;
+	}
+	for(i = 0; i < 4; i++) {
+		for(b = 0; b < 256; b++) {
+			uint32_t out = 0;
+			int bit;
+			for(bit = 0; bit < 8; bit++)
+				if(b & (1 << bit))
+					out |= dest[i * 8 + bit];
+			remap_table[i][b] = out;
+		}
+	}
+}
+
+void remapSamples(SceCtrlData *ctrl, int count) {
+	int core = cpu_id();
+	unsigned int start = pmu_cycles();
+	for(int i = 0; i < count; i++) {
+		uint32_t b = ctrl[i].buttons;
+		ctrl[i].buttons = remap_table[0][b & 0xFF] | remap_table[1][(b >> 8) & 0xFF] |
+			remap_table[2][(b >> 16) & 0xFF] | remap_table[3][b >> 24];
+	}
+	unsigned int cycles = pmu_cycles() - start;
+	// the counter is per core: drop the timing if we migrated, were preempted or it isn't running
+	if(cpu_id() != core || !pmu_running() || cycles > REMAP_MAX_CYCLES * (unsigned int)(count + 1))
+		return;
+	remap_cycles += cycles;
+	remap_samples += count;
+}
+
 void reset_config() {
 	memset(&current_config, 0, sizeof(current_config));
+	build_remap_table();
 }
 
 int load_config() {
+	reset_config();
 	snprintf(config_path, sizeof(config_path), CONFIG_PATH"%s/config.bin", titleid);
 	printf("loaded %s\n", config_path);
 	if(ReadFile(config_path, &current_config, sizeof(current_config))<0) {
@@ -108,6 +358,7 @@ int load_config() {
 			return -1;
 		}
 	}
+	build_remap_table();
 	return 0;
 }
 
@@ -127,16 +378,317 @@ int save_default_config() {
 	return 0;	
 }
 
+// Clock residency: how long each domain spent at each frequency for the title
+// in front, and how many of the title's own clock requests were overridden
+#define RES_MAGIC            0x3153524C // "LRS1"
+#define RES_FREQS            8
+#define RES_SAVE_INTERVAL    (30 * TIMER_SECOND)
+typedef struct residency_bin {
+	uint16_t mhz;
+	uint16_t reserved;
+	uint32_t ms;
+} residency_bin;
+typedef struct residency_stats {
+	uint32_t magic;
+	uint32_t requests[5], overridden[5];
+	residency_bin bins[5][RES_FREQS];
+} residency_stats;
+static const char *DOMAIN_NAMES[5] = {"ARM", "BUS", "GPU ES4", "XBAR", "GPU"};
+static residency_stats residency;
+static SceUID res_mutex = -1;
+static int res_current[5];
+static uint64_t res_since = 0, res_saved = 0;
+static char res_titleid[32];
+
+// caller holds res_mutex
+static void residency_accrue(uint64_t now) {
+	uint32_t ms = (now - res_since) / 1000;
+	if(!res_since || !ms)
+		return;
+	for(int d = 0; d < 5; d++) {
+		if(!res_current[d])
+			continue;
+		for(int i = 0; i < RES_FREQS; i++) {
+			residency_bin *bin = &residency.bins[d][i];
+			if(bin->mhz == res_current[d] || !bin->mhz) {
+				bin->mhz = res_current[d];
+				bin->ms += ms;
+				break;
+			}
+		}
+	}
+	res_since += ms * 1000;
+}
+
+void residency_set(int domain, int mhz, int requested) {
+	ksceKernelLockMutex(res_mutex, 1, NULL);
+	uint64_t now = ksceKernelGetProcessTimeWideCore();
+	residency_accrue(now);
+	if(!res_since)
+		res_since = now;
+	res_current[domain] = mhz;
+	if(requested) {
+		residency.requests[domain]++;
+		if(requested != mhz)
+			residency.overridden[domain]++;
+	}
+	ksceKernelUnlockMutex(res_mutex, 1);
+}
+
+// Sampler thread only: write the focused title's table, and swap tables when the title changed
+void residency_sync() {
+	char path[PATH_MAX];
+	residency_stats copy;
+	uint64_t now = ksceKernelGetProcessTimeWideCore();
+	int switched = strncmp(res_titleid, titleid, sizeof(res_titleid)) != 0;
+	if(!switched && now - res_saved < RES_SAVE_INTERVAL)
+		return;
+	ksceKernelLockMutex(res_mutex, 1, NULL);
+	residency_accrue(now);
+	copy = residency;
+	ksceKernelUnlockMutex(res_mutex, 1);
+	if(res_titleid[0]) {
+		snprintf(path, sizeof(path), CONFIG_PATH"%s", res_titleid);
+		ksceIoMkdir(path, 6);
+		snprintf(path, sizeof(path), CONFIG_PATH"%s/residency.bin", res_titleid);
+		WriteFile(path, &copy, sizeof(copy));
+	}
+	res_saved = now;
+	if(!switched)
+		return;
+	strncpy(res_titleid, titleid, sizeof(res_titleid));
+	snprintf(path, sizeof(path), CONFIG_PATH"%s/residency.bin", res_titleid);
+	if(ReadFile(path, &copy, sizeof(copy)) != sizeof(copy) || copy.magic != RES_MAGIC) {
+		memset(&copy, 0, sizeof(copy));
+		copy.magic = RES_MAGIC;
+	}
+	ksceKernelLockMutex(res_mutex, 1, NULL);
+	residency_accrue(ksceKernelGetProcessTimeWideCore());
+	residency = copy;
+	ksceKernelUnlockMutex(res_mutex, 1);
+}
+
 void refreshClocks() {
 	isReseting = 1;
-	kscePowerSetArmClockFrequency(profiles[current_config.mode][0]);
-	kscePowerSetBusClockFrequency(profiles[current_config.mode][1]);
-	kscePowerSetGpuEs4ClockFrequency(profiles[current_config.mode][2], profiles[current_config.mode][2]);
-	kscePowerSetGpuXbarClockFrequency(profiles[current_config.mode][3]);
-	kscePowerSetGpuClockFrequency(profiles[current_config.mode][4]);
+	int *clocks = ACTIVE_PROFILE;
+	kscePowerSetArmClockFrequency(clocks[0]);
+	kscePowerSetBusClockFrequency(clocks[1]);
+	kscePowerSetGpuEs4ClockFrequency(clocks[2], clocks[2]);
+	kscePowerSetGpuXbarClockFrequency(clocks[3]);
+	kscePowerSetGpuClockFrequency(clocks[4]);
+	residency_set(4, clocks[4], 0); // not hooked, account it here
 	isReseting = 0;
 }
 
+// Clock validator: walks every profile and an ARM sweep, timing each set call,
+// checking the readbacks and running a fixed workload at each step. Only started
+// from the shell and aborted if focus moves, it never touches current_config.
+#define VALIDATOR_PATH       CONFIG_PATH"validator.txt"
+#define VALIDATOR_WORK       4000000
+#define VALIDATOR_SETTLE     100000
+static const int validator_arm[] = {111, 166, 222, 333, 444, 500};
+#define VALIDATOR_STEPS (5 + sizeof(validator_arm) / sizeof(validator_arm[0]))
+static SceUID validator_thid = -1;
+static int validator_step = -1, validator_mismatches = 0;
+
+static uint32_t validator_workload() {
+	volatile uint32_t sink;
+	uint32_t x = 1;
+	for(int i = 0; i < VALIDATOR_WORK; i++) {
+		x = x * 1664525 + 1013904223;
+		x ^= x >> 13;
+	}
+	sink = x;
+	return sink;
+}
+
+static int validator_thread(SceSize args, void *argp) {
+	char line[256];
+	int clocks[5], set_us[5], got[5];
+	int base_score = 0, base_mhz = 0;
+	uint64_t start;
+
+	validator_mismatches = 0;
+	snprintf(line, sizeof(line), "step  arm bus es4 xbar gpu | set us arm bus es4 xbar gpu | got arm bus es4 xbar gpu | r1 r2 speed | iter/ms scale | ok\n");
+	WriteFile(VALIDATOR_PATH, line, strlen(line));
+
+	// the power hooks apply validator_clocks instead of the focused title's profile
+	for(validator_step = 0; validator_step < VALIDATOR_STEPS; validator_step++) {
+		if(!isShell) {
+			snprintf(line, sizeof(line), "aborted at step %d, focus moved to %s\n", validator_step, titleid);
+			AppendFile(VALIDATOR_PATH, line, strlen(line));
+			break;
+		}
+		if(validator_step < 5)
+			memcpy(clocks, profiles[validator_step], sizeof(clocks));
+		else {
+			memcpy(clocks, profile_game, sizeof(clocks));
+			clocks[0] = validator_arm[validator_step - 5];
+		}
+		validator_clocks = clocks;
+
+		isReseting = 1;
+		start = ksceKernelGetProcessTimeWideCore();
+		kscePowerSetArmClockFrequency(clocks[0]);
+		set_us[0] = ksceKernelGetProcessTimeWideCore() - start;
+		start = ksceKernelGetProcessTimeWideCore();
+		kscePowerSetBusClockFrequency(clocks[1]);
+		set_us[1] = ksceKernelGetProcessTimeWideCore() - start;
+		start = ksceKernelGetProcessTimeWideCore();
+		kscePowerSetGpuEs4ClockFrequency(clocks[2], clocks[2]);
+		set_us[2] = ksceKernelGetProcessTimeWideCore() - start;
+		start = ksceKernelGetProcessTimeWideCore();
+		kscePowerSetGpuXbarClockFrequency(clocks[3]);
+		set_us[3] = ksceKernelGetProcessTimeWideCore() - start;
+		start = ksceKernelGetProcessTimeWideCore();
+		kscePowerSetGpuClockFrequency(clocks[4]);
+		set_us[4] = ksceKernelGetProcessTimeWideCore() - start;
+		residency_set(4, clocks[4], 0); // not hooked, account it here like refreshClocks
+		isReseting = 0;
+		ksceKernelDelayThread(VALIDATOR_SETTLE);
+
+		int r1, r2;
+		got[0] = kscePowerGetArmClockFrequency();
+		got[1] = kscePowerGetBusClockFrequency();
+		kscePowerGetGpuEs4ClockFrequency(&r1, &r2);
+		got[2] = r1;
+		got[3] = kscePowerGetGpuXbarClockFrequency();
+		got[4] = kscePowerGetGpuClockFrequency();
+
+		// 500 is reported as 444 by the power service, the pervasive registers tell the truth
+		int ok = 1;
+		for(int i = 1; i < 5; i++)
+			if(got[i] != clocks[i])
+				ok = 0;
+		if(clocks[0] == 500)
+			ok = ok && *clock_r1 == 0xF && *clock_r2 == 0x0 && *clock_speed == 500;
+		else
+			ok = ok && got[0] == clocks[0];
+
+		start = ksceKernelGetProcessTimeWideCore();
+		validator_workload();
+		int work_us = ksceKernelGetProcessTimeWideCore() - start;
+		int score = work_us ? (int)((uint64_t)VALIDATOR_WORK * 1000 / work_us) : 0;
+		if(!base_score) {
+			base_score = score;
+			base_mhz = clocks[0];
+		}
+		// throughput per MHz relative to the first step, 100 when it scales linearly
+		int scale = base_score ? (int)((uint64_t)score * base_mhz * 100 / ((uint64_t)base_score * clocks[0])) : 0;
+		if(!ok)
+			validator_mismatches++;
+
+		snprintf(line, sizeof(line), "%-4d %4d %3d %3d %4d %3d | %6d %3d %3d %4d %3d | %7d %3d %3d %4d %3d | %2x %2x %5d | %7d %4d%% | %s\n",
+			validator_step, clocks[0], clocks[1], clocks[2], clocks[3], clocks[4],
+			set_us[0], set_us[1], set_us[2], set_us[3], set_us[4],
+			got[0], got[1], got[2], got[3], got[4],
+			*clock_r1, *clock_r2, *clock_speed, score, scale, ok ? "ok" : "MISMATCH");
+		AppendFile(VALIDATOR_PATH, line, strlen(line));
+	}
+
+	// back to whichever title's profile is in front now
+	validator_clocks = NULL;
+	refreshClocks();
+	validator_step = -1;
+	return 0;
+}
+
+int validator_start() {
+	if(!isShell)
+		return -1;
+	if(validator_thid >= 0) {
+		if(validator_step >= 0)
+			return -1;
+		ksceKernelWaitThreadEnd(validator_thid, NULL, NULL);
+		ksceKernelDeleteThread(validator_thid);
+	}
+	validator_thid = ksceKernelCreateThread("LOLIcon_validator", validator_thread, 0x3C, 0x2000, 0, 0, NULL);
+	if(validator_thid < 0)
+		return -1;
+	validator_step = 0;
+	ksceKernelStartThread(validator_thid, 0, NULL);
+	return 0;
+}
+
+// Sampler thread only. Lines are batched and written with one append per sampler
+// pass (log_flush), so logging adds as little storage traffic as possible to the
+// title being measured; the directory is created once per title.
+#define LOG_BUFFER           1024
+static char log_buf[LOG_BUFFER], log_titleid[32], log_dir[32];
+static int log_len = 0;
+
+void log_flush() {
+	char path[PATH_MAX];
+	if(!log_len)
+		return;
+	if(strncmp(log_dir, log_titleid, sizeof(log_dir)) != 0) {
+		snprintf(path, sizeof(path), CONFIG_PATH"%s", log_titleid);
+		ksceIoMkdir(path, 6);
+		strncpy(log_dir, log_titleid, sizeof(log_dir));
+	}
+	snprintf(path, sizeof(path), CONFIG_PATH"%s/log.txt", log_titleid);
+	AppendFile(path, log_buf, log_len);
+	log_len = 0;
+}
+
+void write_log(const char *fmt, ...) {
+	char line[256];
+	va_list list;
+	va_start(list, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, list);
+	va_end(list);
+	if(len <= 0)
+		return;
+	if(len >= sizeof(line))
+		len = sizeof(line) - 1;
+	if(log_len && (log_len + len > LOG_BUFFER || strncmp(log_titleid, titleid, sizeof(log_titleid)) != 0))
+		log_flush();
+	if(!log_len)
+		strncpy(log_titleid, titleid, sizeof(log_titleid));
+	memcpy(log_buf + log_len, line, len);
+	log_len += len;
+}
+
+void session_save(SceUID pid, const char *id) {
+	session_state *session = &sessions[0];
+	for(int i = 0; i < SESSION_COUNT; i++) {
+		if(sessions[i].pid == pid) {
+			session = &sessions[i];
+			break;
+		}
+		if(sessions[i].time < session->time)
+			session = &sessions[i];
+	}
+	session->pid = pid;
+	session->time = ksceKernelGetProcessTimeWideCore();
+	strncpy(session->titleid, id, sizeof(session->titleid));
+	session->config = current_config;
+	memcpy(session->clocks, profiles[current_config.mode], sizeof(session->clocks));
+	session->fps = fps;
+	session->frame_avg = frame_avg;
+	session->frame_dev = frame_dev;
+}
+
+int session_restore(SceUID pid, const char *id) {
+	for(int i = 0; i < SESSION_COUNT; i++) {
+		session_state *session = &sessions[i];
+		if(session->pid != pid || strncmp(session->titleid, id, sizeof(session->titleid)) != 0)
+			continue;
+		current_config = session->config;
+		build_remap_table();
+		// the default profile follows the game's own requests, put those back too
+		if(current_config.mode == 0)
+			memcpy(profile_default, session->clocks, sizeof(session->clocks));
+		refreshClocks();
+		fps = session->fps;
+		frame_avg = session->frame_avg;
+		frame_dev = session->frame_dev;
+		error_code = SESSION_GOOD;
+		return 0;
+	}
+	return -1;
+}
+
 void load_and_refresh() {
 	error_code = LOAD_GOOD;
 	if(load_config()<0) 
@@ -147,14 +699,654 @@ void load_and_refresh() {
 
 
 // This function is from VitaJelly by DrakonPL and Rinne's framecounter
-void doFps() {
-	fps_count++;
+void doFps(int draw, int count) {
+	if(count)
+		fps_count++;
 	if ((curTime - lateTime) > TIMER_SECOND) {
 		lateTime = curTime;
 		fps = (int)fps_count;
 		fps_count = 0;
 	}
-	blit_stringf(20, 15, "%d",  fps);
+	if(draw)
+		blit_stringf(20, 15, "%d",  fps);
+}
+
+unsigned int isqrt(uint64_t n) {
+	uint64_t root = 0, bit = 1ULL << 62;
+	while(bit > n)
+		bit >>= 2;
+	while(bit) {
+		if(n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else
+			root >>= 1;
+		bit >>= 2;
+	}
+	return (unsigned int)root;
+}
+
+// Holds the flip until its vblank slot. Targets are advanced by a whole number
+// of vblanks from the previous target (not from "now"), so a late frame does not
+// push every following frame later and intervals stay even.
+// The same base submitted again before the next vblank is a repeated or paired
+// call for a flip already limited and counted
+int isRepeatFlip(const SceDisplayFrameBuf *fb) {
+	return fb->base == flip_base && ksceDisplayGetVcount() == flip_vcount;
+}
+
+void doFrameLimit(int sync) {
+	if(!current_config.fpsCap) {
+		limit_vcount = 0;
+		return;
+	}
+	int interval = VBLANK_RATE / current_config.fpsCap;
+	int vcount = ksceDisplayGetVcount();
+	if(!limit_vcount || vcount - limit_vcount > interval)
+		limit_vcount = vcount;
+	else
+		limit_vcount += interval;
+	// a synced flip is latched on the next vblank, so release it one vblank early
+	int release = (sync == SCE_DISPLAY_SETBUF_NEXTFRAME) ? limit_vcount - 1 : limit_vcount;
+	while(ksceDisplayGetVcount() - release < 0)
+		ksceDisplayWaitVblankStart();
+}
+
+// Frame interval mean and standard deviation, refreshed once per second
+void doFrameStats() {
+	uint64_t now = ksceKernelGetProcessTimeWideCore();
+	if(frame_last && now > frame_last) {
+		uint64_t delta = now - frame_last;
+		frame_count++;
+		frame_sum += delta;
+		frame_sumsq += delta * delta;
+	}
+	frame_last = now;
+	if(now - frame_window > TIMER_SECOND) {
+		frame_window = now;
+		if(frame_count) {
+			uint64_t mean = frame_sum / frame_count;
+			uint64_t var = frame_sumsq / frame_count;
+			frame_avg = (int)mean;
+			frame_dev = var > mean * mean ? isqrt(var - mean * mean) : 0;
+		}
+		frame_count = frame_sum = frame_sumsq = 0;
+	}
+}
+
+void reset_mem_stats() {
+	mem_time = mem_seen = mem_last_free = mem_growth = 0;
+	memset(mem_peak_free, 0, sizeof(mem_peak_free));
+	memset(&mem_proc, 0, sizeof(mem_proc));
+}
+
+void reset_stats() {
+	reset_mem_stats();
+	// unmerged measurements are tagged with their title and merged by the sampler
+	memset(lat_saved, 0, sizeof(lat_saved));
+	lat_press = lat_buttons = 0;
+	lat_dirty = 1;
+	boost_frame_sum[0] = boost_frame_sum[1] = boost_frame_n[0] = boost_frame_n[1] = 0;
+	memset(osd_bases, 0, sizeof(osd_bases));
+	flip_base = NULL;
+}
+
+// Wake the sampler thread early, e.g. to act on a focus change right away
+void focus_changed() {
+	hooks_dirty = 1;
+	if(sampler_sema >= 0)
+		ksceKernelSignalSema(sampler_sema, 1);
+}
+
+int read_latency(const char *id, latency_stats *stats) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), CONFIG_PATH"%s/latency.bin", id);
+	if(ReadFile(path, stats, sizeof(lat_saved)) != sizeof(lat_saved)) {
+		memset(stats, 0, sizeof(lat_saved));
+		return -1;
+	}
+	return 0;
+}
+
+int load_latency() {
+	return read_latency(titleid, lat_saved);
+}
+
+// Sampler thread only: merge what was measured since the last call into the
+// file of the title it was measured on, like launchSave
+int save_latency() {
+	char path[PATH_MAX];
+	latency_stats merged[5];
+	int retired = lat_cur;
+	lat_cur = !retired;
+	__sync_synchronize();
+	while(lat_writers)
+		ksceKernelDelayThread(100);
+	latency_pending *pending = &lat_pending[retired];
+	if(!pending->titleid[0])
+		return 0;
+	snprintf(path, sizeof(path), CONFIG_PATH"%s", pending->titleid);
+	ksceIoMkdir(path, 6);
+	read_latency(pending->titleid, merged);
+	for(int i = 0; i < 5; i++) {
+		latency_stats *to = &merged[i], *from = &pending->stats[i];
+		if(!from->count)
+			continue;
+		if(!to->count || from->min < to->min)
+			to->min = from->min;
+		if(from->max > to->max)
+			to->max = from->max;
+		to->sum += from->sum;
+		to->count += from->count;
+		for(int j = 0; j < LAT_BUCKETS; j++)
+			to->hist[j] += from->hist[j];
+	}
+	snprintf(path, sizeof(path), CONFIG_PATH"%s/latency.bin", pending->titleid);
+	int ret = WriteFile(path, merged, sizeof(merged));
+	if(strncmp(pending->titleid, titleid, sizeof(titleid)) == 0)
+		memcpy(lat_saved, merged, sizeof(merged));
+	memset(pending, 0, sizeof(*pending));
+	return ret < 0 ? -1 : 0;
+}
+
+// A sparse 8x8 grid of pixels, enough to tell whether the picture changed
+#define FRAME_SAMPLES 64
+int frameSample(const SceDisplayFrameBuf *fb, uint32_t *out) {
+	if(!fb->base || !fb->width || !fb->height)
+		return -1;
+	for(int y = 0; y < 8; y++) {
+		for(int x = 0; x < 8; x++) {
+			uint32_t *addr = (uint32_t *)fb->base + (fb->height * (2 * y + 1) / 16) * fb->pitch + fb->width * (2 * x + 1) / 16;
+			if(ksceKernelMemcpyUserToKernel(&out[y * 8 + x], (uintptr_t)addr, sizeof(uint32_t)) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+uint32_t frameSignature(const SceDisplayFrameBuf *fb) {
+	uint32_t sig = 0, samples[FRAME_SAMPLES];
+	if(frameSample(fb, samples) < 0)
+		return 0;
+	for(int i = 0; i < FRAME_SAMPLES; i++)
+		sig = (sig ^ samples[i]) * 16777619;
+	return sig;
+}
+
+// Input side: remember when the first poll reported a new press
+void latencyInput(SceCtrlData *ctrl, int count) {
+	for(int i = 0; i < count; i++) {
+		uint32_t pressed = ctrl[i].buttons & ~lat_buttons;
+		lat_buttons = ctrl[i].buttons;
+		if(pressed && !lat_press) {
+			lat_base_sig = lat_last_sig;
+			lat_press = ctrl[i].timeStamp;
+		}
+	}
+}
+
+// Display side: the press is answered by the first flip whose content differs
+// from the frame that was on screen when it happened
+void latencyFlip(const SceDisplayFrameBuf *fb) {
+	uint32_t sig = frameSignature(fb);
+	if(lat_press) {
+		uint64_t now = ksceKernelGetSystemTimeWide(); // same clock as SceCtrlData.timeStamp
+		if(sig != lat_base_sig && now > lat_press) {
+			__sync_fetch_and_add(&lat_writers, 1);
+			latency_pending *pending = &lat_pending[lat_cur];
+			// a buffer holds one title; right after a focus change the sampler merges it within a pass
+			if(!pending->titleid[0])
+				strncpy(pending->titleid, titleid, sizeof(pending->titleid));
+			if(strncmp(pending->titleid, titleid, sizeof(titleid)) != 0) {
+				__sync_fetch_and_sub(&lat_writers, 1);
+				lat_press = 0;
+				return;
+			}
+			latency_stats *stats = &pending->stats[current_config.mode];
+			uint32_t us = (uint32_t)(now - lat_press);
+			int bucket = us / LAT_BUCKET_US;
+			stats->hist[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+			if(!stats->count || us < stats->min)
+				stats->min = us;
+			if(us > stats->max)
+				stats->max = us;
+			stats->sum += us;
+			stats->count++;
+			__sync_fetch_and_sub(&lat_writers, 1);
+			lat_last_us = us;
+			lat_dirty = 1;
+			lat_press = 0;
+		} else if(now - lat_press > TIMER_SECOND)
+			lat_press = 0;
+	}
+	lat_last_sig = sig;
+}
+
+// Number of buckets up to and including the one holding the given percentile
+int histPercentile(const uint32_t *hist, int buckets, uint32_t count, int percent) {
+	uint32_t seen = 0, want = (count * percent + 99) / 100;
+	for(int i = 0; i < buckets; i++) {
+		seen += hist[i];
+		if(seen >= want)
+			return i + 1;
+	}
+	return buckets;
+}
+
+// Upper bound of the histogram bucket holding the given percentile, in ms
+int latencyPercentile(latency_stats *stats, int percent) {
+	return histPercentile(stats->hist, LAT_BUCKETS, stats->count, percent) * LAT_BUCKET_US / 1000;
+}
+
+// Launch profiler: process start -> title ID known -> first flip -> first flip
+// that differs from it in a good part of the screen. All times in ms.
+void launchStart(SceUID pid) {
+	launch_pid = pid;
+	launch_start = ksceKernelGetProcessTimeWideCore();
+	launch_resolve = launch_flip = launch_content = 0;
+}
+
+void launchResolved() {
+	if(!launch_start || launch_resolve)
+		return;
+	launch_resolve = (ksceKernelGetProcessTimeWideCore() - launch_start) / 1000;
+	strncpy(launch_titleid, titleid, sizeof(launch_titleid));
+	if(launch_content)
+		launch_dirty = 1;
+}
+
+void launchFlip(const SceDisplayFrameBuf *fb) {
+	uint32_t samples[FRAME_SAMPLES];
+	uint64_t elapsed = ksceKernelGetProcessTimeWideCore() - launch_start;
+	if(elapsed > LAUNCH_TIMEOUT) {
+		launch_start = 0;
+		return;
+	}
+	if(frameSample(fb, samples) < 0)
+		return;
+	if(!launch_flip) {
+		launch_flip = elapsed / 1000;
+		memcpy(launch_ref, samples, sizeof(launch_ref));
+		return;
+	}
+	int changed = 0;
+	for(int i = 0; i < FRAME_SAMPLES; i++)
+		if(samples[i] != launch_ref[i])
+			changed++;
+	if(changed >= LAUNCH_CHANGED) {
+		launch_content = elapsed / 1000;
+		if(launch_resolve)
+			launch_dirty = 1;
+	}
+}
+
+// Runs on the sampler thread: fold the finished launch into the title's history
+void launchSave() {
+	char path[PATH_MAX];
+	uint32_t ms[3] = {launch_resolve, launch_flip, launch_content};
+	snprintf(path, sizeof(path), CONFIG_PATH"%s", launch_titleid);
+	ksceIoMkdir(path, 6);
+	snprintf(path, sizeof(path), CONFIG_PATH"%s/launch.bin", launch_titleid);
+	if(ReadFile(path, launch_data, sizeof(launch_data)) != sizeof(launch_data))
+		memset(launch_data, 0, sizeof(launch_data));
+	launch_stats *stats = &launch_data[current_config.mode];
+	for(int i = 0; i < 3; i++) {
+		stats->sum[i] += ms[i];
+		if(!stats->count || ms[i] < stats->min[i])
+			stats->min[i] = ms[i];
+		if(ms[i] > stats->max[i])
+			stats->max[i] = ms[i];
+	}
+	int bucket = launch_content / 1000;
+	stats->hist[bucket < LAUNCH_BUCKETS ? bucket : LAUNCH_BUCKETS - 1]++;
+	stats->count++;
+	WriteFile(path, launch_data, sizeof(launch_data));
+	if(current_config.logging)
+		write_log("launch id %u ms first flip %u ms content %u ms profile %d\n", ms[0], ms[1], ms[2], current_config.mode);
+}
+
+uint32_t memFree(int type) {
+	switch(type) {
+		case MEM_USER:
+			return mem_proc.size_user;
+		case MEM_CDRAM:
+			return mem_proc.size_cdram;
+		default:
+			return mem_proc.size_phycont;
+	}
+}
+
+uint32_t memUsed(int type) {
+	return mem_peak_free[type] - memFree(type);
+}
+
+// The free memory query reports on the calling process, so it has to run on one
+// of the title's own threads. Its input polls are frequent enough; only take a
+// snapshot here, the sampler thread does the rest.
+void sampleProcessMemory() {
+	uint64_t now = ksceKernelGetProcessTimeWideCore();
+	if(!ksceKernelGetFreeMemorySize || now - mem_time < TIMER_SECOND)
+		return;
+	SceKernelFreeMemorySizeInfo info;
+	info.size = sizeof(info);
+	if(ksceKernelGetFreeMemorySize(&info) == 0) {
+		mem_proc = info;
+		mem_time = now;
+	}
+}
+
+// PSP game IDs look like ULUS10041 or NPJH50001, optionally with a dash
+int readPspEmuTitle(SceUID pid, char *out, int size) {
+	char id[sizeof(((SceAdrenaline *)0)->titleid)];
+	int i, j = 0;
+	if(ksceKernelMemcpyUserToKernelForPid(pid, id, 
+		PSPEMU_ADRENALINE_ADDR + __builtin_offsetof(SceAdrenaline, titleid), sizeof(id)) < 0)
+		return -1;
+	for(i = 0; i < sizeof(id) && id[i] && j < size - 1; i++) {
+		if(id[i] == '-')
+			continue;
+		if(j < 4 ? (id[i] < 'A' || id[i] > 'Z') : (id[i] < '0' || id[i] > '9'))
+			return -1;
+		out[j++] = id[i];
+	}
+	out[j] = 0;
+	return j == 9 ? 0 : -1;
+}
+
+// Polled while the emulator is in front: follow it from its own title ID to the game it
+// runs, and from one game to the next when another one is started in the same session
+void resolvePspEmuTitle() {
+	char id[32];
+	if(readPspEmuTitle(current_pid, id, sizeof(id)) < 0 || strncmp(id, titleid, sizeof(titleid)) == 0)
+		return;
+	save_latency(); // still tagged with the emulator's ID
+	strncpy(titleid, id, sizeof(titleid));
+	reset_stats();
+	load_and_refresh();
+	hooks_dirty = 1;
+}
+
+void boost_revert() {
+	for(int i = 0; i < boosted_count; i++) {
+		// fails harmlessly once the thread or its process is gone
+		ksceKernelChangeThreadPriority(boosted[i].thid, boosted[i].priority);
+		ksceKernelChangeThreadCpuAffinityMask(boosted[i].thid, boosted[i].affinity);
+	}
+	boosted_count = 0;
+	memset(boost_top, 0, sizeof(boost_top));
+	boost_active = 0;
+}
+
+// Threads left on any user core; an affinity the game chose itself is never overridden
+static int boost_movable(int affinity) {
+	return affinity == 0 || affinity == (SCE_KERNEL_CPU_MASK_USER_0 | SCE_KERNEL_CPU_MASK_USER_1 | SCE_KERNEL_CPU_MASK_USER_2);
+}
+
+// The heaviest threads get a user core each and a higher priority, every other
+// movable thread of the title is moved to the remaining core so those two are
+// really dedicated. Runs every BOOST_INTERVAL so new threads get moved as well.
+void boost_apply(const SceUID *ids, int count, const SceUID *top) {
+	SceKernelThreadInfo info;
+	SceUID previous[BOOST_THREADS];
+	int kept = 0;
+
+	if(!top[0]) {
+		boost_revert();
+		return;
+	}
+	// threads that are gone have nothing to restore
+	for(int i = 0; i < boosted_count; i++)
+		for(int j = 0; j < count; j++)
+			if(boosted[i].thid == ids[j]) {
+				boosted[kept++] = boosted[i];
+				break;
+			}
+	boosted_count = kept;
+	memcpy(previous, boost_top, sizeof(previous));
+	memcpy(boost_top, top, sizeof(boost_top));
+	boost_active = 0;
+
+	for(int i = 0; i < count; i++) {
+		boosted_thread *saved = NULL;
+		int rank = -1, was_top = 0;
+		for(int j = 0; j < boosted_count; j++)
+			if(boosted[j].thid == ids[i])
+				saved = &boosted[j];
+		if(!saved) {
+			info.size = sizeof(info);
+			if(boosted_count >= BOOST_MAX_THREADS || ksceKernelGetThreadInfo(ids[i], &info) < 0)
+				continue;
+			saved = &boosted[boosted_count++];
+			saved->thid = ids[i];
+			saved->priority = info.currentPriority;
+			saved->affinity = info.currentCpuAffinityMask;
+		}
+		for(int j = 0; j < BOOST_THREADS; j++) {
+			if(top[j] == ids[i])
+				rank = j;
+			if(previous[j] == ids[i])
+				was_top = 1;
+		}
+		if(rank >= 0) {
+			int priority = saved->priority - BOOST_PRIORITY_STEP;
+			ksceKernelChangeThreadPriority(ids[i], priority < BOOST_PRIORITY_MAX ? BOOST_PRIORITY_MAX : priority);
+			if(boost_movable(saved->affinity))
+				ksceKernelChangeThreadCpuAffinityMask(ids[i], boost_masks[rank]);
+			boost_active = 1;
+		} else {
+			if(was_top)
+				ksceKernelChangeThreadPriority(ids[i], saved->priority);
+			if(boost_movable(saved->affinity))
+				ksceKernelChangeThreadCpuAffinityMask(ids[i], BOOST_OTHER_MASK);
+		}
+	}
+}
+
+// Find the threads of the focused title that ran the most since the last look
+// and give them their own cores and a higher priority, see boost_apply
+void boost_sample() {
+	SceUID pid = (!isShell && current_config.boost) ? current_pid : 0, ids[BOOST_MAX_THREADS];
+	SceUID top[BOOST_THREADS];
+	uint64_t run[BOOST_MAX_THREADS], top_delta[BOOST_THREADS];
+	SceKernelThreadInfo info;
+	int count = 0;
+
+	if(pid != boost_pid) {
+		boost_revert();
+		boost_pid = pid;
+		boost_count = boost_ticks = 0;
+	}
+	if(!pid || !ksceKernelGetThreadIdList || ksceKernelGetThreadIdList(pid, ids, BOOST_MAX_THREADS, &count) < 0)
+		return;
+	memset(top, 0, sizeof(top));
+	memset(top_delta, 0, sizeof(top_delta));
+	for(int i = 0; i < count; i++) {
+		info.size = sizeof(info);
+		run[i] = ksceKernelGetThreadInfo(ids[i], &info) < 0 ? 0 : info.runClocks;
+		uint64_t delta = 0;
+		for(int j = 0; j < boost_count; j++)
+			if(boost_thids[j] == ids[i] && run[i] > boost_run[j])
+				delta = run[i] - boost_run[j];
+		for(int j = 0; j < BOOST_THREADS; j++) {
+			if(delta > top_delta[j]) {
+				for(int k = BOOST_THREADS - 1; k > j; k--) {
+					top[k] = top[k - 1];
+					top_delta[k] = top_delta[k - 1];
+				}
+				top[j] = ids[i];
+				top_delta[j] = delta;
+				break;
+			}
+		}
+	}
+	memcpy(boost_thids, ids, count * sizeof(SceUID));
+	memcpy(boost_run, run, count * sizeof(uint64_t));
+	boost_count = count;
+	if(++boost_ticks % BOOST_INTERVAL)
+		return;
+	boost_apply(ids, count, top);
+}
+
+void io_account(int dir, int ret, uint64_t us) {
+	io_counters *counters = &io_cpu[cpu_id()];
+	int bucket = 0;
+	while(us > 1 && bucket < IO_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	__sync_fetch_and_add(&counters->ops[dir], 1);
+	if(ret > 0)
+		__sync_fetch_and_add(&counters->bytes[dir], (uint64_t)ret);
+	__sync_fetch_and_add(&counters->hist[dir][bucket], 1);
+}
+
+// About once a second: turn the running totals into rates over the time actually
+// elapsed (the sampler can be woken early and its own I/O adds up) and a p99
+void io_sample() {
+	io_counters total, delta;
+	uint64_t now = ksceKernelGetProcessTimeWideCore(), elapsed = now - io_last_time;
+	if(io_last_time && elapsed < TIMER_SECOND / 2)
+		return;
+	memset(&total, 0, sizeof(total));
+	for(int cpu = 0; cpu < 4; cpu++) {
+		for(int dir = 0; dir < 2; dir++) {
+			total.ops[dir] += io_cpu[cpu].ops[dir];
+			total.bytes[dir] += io_cpu[cpu].bytes[dir];
+			for(int i = 0; i < IO_BUCKETS; i++)
+				total.hist[dir][i] += io_cpu[cpu].hist[dir][i];
+		}
+	}
+	for(int dir = 0; dir < 2; dir++) {
+		delta.ops[dir] = total.ops[dir] - io_last.ops[dir];
+		delta.bytes[dir] = total.bytes[dir] - io_last.bytes[dir];
+		for(int i = 0; i < IO_BUCKETS; i++)
+			delta.hist[dir][i] = total.hist[dir][i] - io_last.hist[dir][i];
+		io_ops[dir] = io_last_time ? (uint64_t)delta.ops[dir] * TIMER_SECOND / elapsed : 0;
+		io_kbps[dir] = io_last_time ? (delta.bytes[dir] * TIMER_SECOND / elapsed) >> 10 : 0;
+		io_p99[dir] = delta.ops[dir] ? 1 << histPercentile(delta.hist[dir], IO_BUCKETS, delta.ops[dir], 99) : 0;
+	}
+	io_last = total;
+	io_last_time = now;
+	if(current_config.logging && !isShell && (io_ops[IO_READ] || io_ops[IO_WRITE]))
+		write_log("%llu io read %d KB/s %d ops/s p99 %d us write %d KB/s %d ops/s p99 %d us\n", now, 
+			io_kbps[IO_READ], io_ops[IO_READ], io_p99[IO_READ], io_kbps[IO_WRITE], io_ops[IO_WRITE], io_p99[IO_WRITE]);
+}
+
+static int sampler_thread(SceSize args, void *argp) {
+	while(sampler_run) {
+		if(hooks_dirty) { // set on every focus change
+			hooks_dirty = 0;
+			hooks_apply();
+			if(!isShell)
+				load_latency();
+		}
+		if(isPspEmu)
+			resolvePspEmuTitle();
+		boost_sample();
+		residency_sync();
+		if(current_config.ioStats)
+			io_sample();
+		if(!isShell && frame_avg) {
+			boost_frame_sum[boost_active] += frame_avg;
+			boost_frame_n[boost_active]++;
+		}
+		if(ksceKernelGetFreeMemorySize) {
+			mem_kern.size = sizeof(mem_kern);
+			mem_kern_ok = ksceKernelGetFreeMemorySize(&mem_kern) == 0;
+		}
+		if(mem_time != mem_seen) {
+			mem_seen = mem_time;
+			uint32_t free = mem_proc.size_user + mem_proc.size_cdram + mem_proc.size_phycont;
+			for(int i = 0; i < 3; i++)
+				if(memFree(i) > mem_peak_free[i])
+					mem_peak_free[i] = memFree(i);
+			if(mem_last_free && free < mem_last_free)
+				mem_growth++;
+			else if(free > mem_last_free)
+				mem_growth = 0;
+			mem_last_free = free;
+			if(current_config.logging && !isShell)
+				write_log("%llu mem user:%u cdram:%u phycont:%u kernel_proc_user:%d growth:%d\n", mem_seen,
+					mem_proc.size_user, mem_proc.size_cdram, mem_proc.size_phycont, mem_kern_ok ? (int)mem_kern.size_user : -1, mem_growth);
+		}
+		if(current_config.logging && !isShell)
+			write_log("%llu fps %d frame %d+-%d us profile %d boost %d\n", ksceKernelGetProcessTimeWideCore(), 
+				fps, frame_avg, frame_dev, current_config.mode, boost_active);
+		if(launch_dirty) {
+			launch_dirty = 0;
+			launch_start = 0;
+			launchSave();
+		}
+		if(lat_dirty) {
+			lat_dirty = 0;
+			save_latency();
+			if(current_config.logging && !isShell && lat_last_us)
+				write_log("%llu latency %u us profile %d\n", ksceKernelGetProcessTimeWideCore(), lat_last_us, current_config.mode);
+			lat_last_us = 0; // logged once
+		}
+		log_flush();
+		if(sampler_sema >= 0) {
+			SceUInt timeout = TIMER_SECOND;
+			ksceKernelWaitSema(sampler_sema, 1, &timeout);
+		} else
+			ksceKernelDelayThread(TIMER_SECOND);
+	}
+	log_flush();
+	boost_revert();
+	return 0;
+}
+
+void doCapture(const SceDisplayFrameBuf *fb) {
+	uint64_t now = ksceKernelGetProcessTimeWideCore();
+	if(now - capture_last < TIMER_SECOND / captureRate)
+		return;
+	capture_last = now;
+	capture_frame(fb, titleid);
+}
+
+void drawMem(int y) {
+	blit_stringf(20, y, "MEM used U%dK C%dK P%dK%s", memUsed(MEM_USER) >> 10, memUsed(MEM_CDRAM) >> 10,
+		memUsed(MEM_PHYCONT) >> 10, mem_growth >= MEM_GROWTH_SAMPLES ? " GROWING" : "");
+}
+
+// Everything the OSD lines depend on; when it changes the overlay is a new generation
+uint32_t overlayKey() {
+	uint32_t key = 2166136261u;
+	#define OVERLAY_KEY(v) key = (key ^ (uint32_t)(v)) * 16777619
+	OVERLAY_KEY(current_config.showFPS ? fps : -1);
+	OVERLAY_KEY(current_config.showBat ? kscePowerGetBatteryLifePercent() : -1);
+	OVERLAY_KEY(current_config.showMem ? mem_time : -1);
+	OVERLAY_KEY(error_code > 0 && (!msg_time || curTime < msg_time));
+	#undef OVERLAY_KEY
+	return key;
+}
+
+// Focused title only. Each base remembers the overlay generation and the vblank it
+// was drawn in. A game may render into any base between two vblanks, single
+// buffered ones included, so the draw is only skipped for a base submitted again
+// within the same vblank with the same overlay, i.e. a repeated or double call
+// for one flip. The menu shows live readouts and is always drawn.
+int needsOverlay(const SceDisplayFrameBuf *fb) {
+	uint32_t key = overlayKey(), vcount = ksceDisplayGetVcount();
+	int i;
+	if(key != osd_key) {
+		osd_key = key;
+		osd_gen++;
+	}
+	for(i = 0; i < OSD_BASES && osd_bases[i].base != fb->base; i++);
+	if(!showMenu && i < OSD_BASES && osd_bases[i].gen == osd_gen && osd_bases[i].vcount == vcount) {
+		osd_skipped++;
+		return 0;
+	}
+	if(i == OSD_BASES) {
+		i = osd_next;
+		osd_next = (osd_next + 1) % OSD_BASES;
+	}
+	osd_bases[i].base = fb->base;
+	osd_bases[i].gen = osd_gen;
+	osd_bases[i].vcount = vcount;
+	osd_drawn++;
+	return 1;
 }
 
 void drawErrors() {
@@ -170,40 +1362,46 @@ int kscePowerSetClockFrequency_patched(tai_hook_ref_t ref_hook, int port, int fr
 	int ret = 0;
 	if(!isReseting)
 		profile_default[port] = freq;
+	int *clocks = ACTIVE_PROFILE;
+	residency_set(port, clocks[port], isReseting ? 0 : freq);
 	if(port==0) {
 		if(freq == 500) {
 			ret = TAI_CONTINUE(int, ref_hook, 444);
 			ksceKernelDelayThread(10000);
-			*clock_speed = profiles[current_config.mode][port];
+			*clock_speed = clocks[port];
 			*clock_r1 = 0xF;
 			*clock_r2 = 0x0;
 			return ret;
 		}
 	} 
 	if(port==2) {
-		ret = TAI_CONTINUE(int, ref_hook, profiles[current_config.mode][port], profiles[current_config.mode][port]);
+		ret = TAI_CONTINUE(int, ref_hook, clocks[port], clocks[port]);
 	} else
-		ret = TAI_CONTINUE(int, ref_hook, profiles[current_config.mode][port]);
+		ret = TAI_CONTINUE(int, ref_hook, clocks[port]);
 	return ret;
 }
 
 static tai_hook_ref_t power_hook1;
 static int power_patched1(int freq) {
+	hook_hits[HOOK_POWER1]++;
 	return kscePowerSetClockFrequency_patched(power_hook1,0,freq);
 }
 
 static tai_hook_ref_t power_hook2;
 static int power_patched2(int freq) {
+	hook_hits[HOOK_POWER2]++;
 	return kscePowerSetClockFrequency_patched(power_hook2,1,freq);
 }
 
 static tai_hook_ref_t power_hook3;
 static int power_patched3(int freq) {
+	hook_hits[HOOK_POWER3]++;
 	return kscePowerSetClockFrequency_patched(power_hook3,2,freq);
 }
 
 static tai_hook_ref_t power_hook4;
 static int power_patched4(int freq) {
+	hook_hits[HOOK_POWER4]++;
 	return kscePowerSetClockFrequency_patched(power_hook4,3,freq);
 }
 
@@ -213,37 +1411,54 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 		ret = 1;
 	else {
 		ret = TAI_CONTINUE(int, ref_hook, port, ctrl, count);
+		int samples = ret > 0 ? ret : 0;
 		if(!showMenu){
-			if (!isPspEmu && (ctrl->buttons & SCE_CTRL_UP)&&(ctrl->buttons & SCE_CTRL_SELECT))
+			if ((ctrl->buttons & SCE_CTRL_UP)&&(ctrl->buttons & SCE_CTRL_SELECT))
 				ctrl_timestamp = showMenu = 1;
-			if (current_config.buttonSwap && 
-				((isShell && shell_pid == ksceKernelGetProcessId())||(!isShell && current_pid == ksceKernelGetProcessId())) && 
-				(ctrl->buttons & 0x6000) && ((ctrl->buttons & 0x6000) != 0x6000))
-					ctrl->buttons = ctrl->buttons ^ 0x6000;
+			if (latencyMode && !isShell && current_pid == ksceKernelGetProcessId())
+				latencyInput(ctrl, samples);
+			if (remap_active && 
+				((isShell && shell_pid == ksceKernelGetProcessId())||(!isShell && current_pid == ksceKernelGetProcessId())))
+					remapSamples(ctrl, samples);
 		} else {
 			unsigned int buttons = ctrl->buttons;
-			ctrl->buttons = 0;
+			for(int i = 0; i < samples; i++)
+				ctrl[i].buttons = 0;
 			if(ctrl->timeStamp > ctrl_timestamp + 300*1000) {
 				if( ksceKernelGetProcessId() == shell_pid) {
 					if (buttons & SCE_CTRL_LEFT){
 						switch(page) {
 							case 1:
-								if(current_config.mode > 0) {
+								if(validator_step < 0 && current_config.mode > 0) {
 									ctrl_timestamp = ctrl->timeStamp;
 									current_config.mode--;
 									refreshClocks();
 								}
 								break;
+							case 3:
+								if(pos > 0) {
+									ctrl_timestamp = ctrl->timeStamp;
+									current_config.remap[pos - 1] = (current_config.remap[pos - 1] + 16) % 17;
+									build_remap_table();
+								}
+								break;
 						}
 					} else if ((buttons & SCE_CTRL_RIGHT)){
 						switch(page) {
 							case 1:
-								if(current_config.mode <4) {
+								if(validator_step < 0 && current_config.mode <4) {
 									ctrl_timestamp = ctrl->timeStamp;
 									current_config.mode++;
 									refreshClocks();
 								}
 								break;
+							case 3:
+								if(pos > 0) {
+									ctrl_timestamp = ctrl->timeStamp;
+									current_config.remap[pos - 1] = (current_config.remap[pos - 1] + 1) % 17;
+									build_remap_table();
+								}
+								break;
 						}
 					} else if((buttons & SCE_CTRL_UP) && pos > 0) {
 						ctrl_timestamp = ctrl->timeStamp;
@@ -252,6 +1467,9 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 						page = pos = 0;
 					 else if (buttons & SCE_CTRL_CROSS) {
 						 switch(page) {
+							case 1:
+								validator_start();
+								break;
 							case 0:
 								switch(pos) {
 									case 0:
@@ -282,15 +1500,19 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 										pos = 0;
 										break;
 									case 6:
-										willexit = current_pid;
+										page = 4;
+										pos = 0;
 										break;
 									case 7:
-										kscePowerRequestSuspend();
+										willexit = current_pid;
 										break;
 									case 8:
-										kscePowerRequestColdReset();
+										kscePowerRequestSuspend();
 										break;
 									case 9:
+										kscePowerRequestColdReset();
+										break;
+									case 10:
 										kscePowerRequestStandby();
 										break;
 								}
@@ -306,6 +1528,9 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 									case 2:
 										current_config.hideErrors = !current_config.hideErrors;
 										break;
+									case 3:
+										current_config.showMem = !current_config.showMem;
+										break;
 	
 								}
 								break;
@@ -314,6 +1539,77 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 									case 0:
 										current_config.buttonSwap = !current_config.buttonSwap;
 										break;
+									default:
+										current_config.remap[pos - 1] = 0;
+										break;
+								}
+								build_remap_table();
+								break;
+							case 7:
+								if(!isShell && hooks[pos].kind == HOOK_INPUT) {
+									current_config.hooksOff ^= 1 << pos;
+									hooks_dirty = 1;
+								}
+								break;
+							case 4:
+								switch(pos) {
+									case 0: {
+										int i = 0;
+										while(i < FPS_CAPS_COUNT - 1 && fps_caps[i] != current_config.fpsCap)
+											i++;
+										current_config.fpsCap = fps_caps[(i + 1) % FPS_CAPS_COUNT];
+										}
+										break;
+									case 1:
+										current_config.logging = !current_config.logging;
+										break;
+									case 2:
+										page = 5;
+										pos = 0;
+										break;
+									case 3:
+										latencyMode = !latencyMode;
+										lat_press = 0;
+										break;
+									case 4:
+										page = 6;
+										pos = 0;
+										break;
+									case 5: {
+										int i = 0;
+										while(i < CAPTURE_RATES_COUNT - 1 && capture_rates[i] != captureRate)
+											i++;
+										i = (i + 1) % CAPTURE_RATES_COUNT;
+										if(!captureRate && capture_start() < 0) {
+											error_code = CAPTURE_ERROR;
+											break;
+										}
+										if(!capture_rates[i])
+											capture_stop();
+										captureRate = capture_rates[i];
+										}
+										break;
+									case 6:
+										page = 7;
+										pos = 0;
+										break;
+									case 7:
+										page = 8;
+										pos = 0;
+										break;
+									case 8:
+										current_config.boost = !current_config.boost;
+										if(sampler_sema >= 0)
+											ksceKernelSignalSema(sampler_sema, 1);
+										break;
+									case 9:
+										current_config.ioStats = !current_config.ioStats;
+										hooks_dirty = 1;
+										break;
+									case 10:
+										page = 9;
+										pos = 0;
+										break;
 								}
 								break;								
 						 }
@@ -330,8 +1626,10 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 		if(KERNEL_PID!=ksceKernelGetProcessId()&& shell_pid!=ksceKernelGetProcessId()) {
 			if(forceReset == 1) {
 				if(current_pid==ksceKernelGetProcessId()) {
-					if(ksceKernelGetProcessTitleId(current_pid, titleid, sizeof(titleid))==0 && titleid[0] != 0) 
+					if(ksceKernelGetProcessTitleId(current_pid, titleid, sizeof(titleid))==0 && titleid[0] != 0) {
 						forceReset = 2;
+						launchResolved();
+					}
 				} else 
 					current_pid=ksceKernelGetProcessId();
 			}
@@ -339,22 +1637,54 @@ int checkButtons(int port, tai_hook_ref_t ref_hook, SceCtrlData *ctrl, int count
 				ksceKernelExitProcess(0);
 			else
 				willexit = 0;
+			if(!forceReset && current_pid == ksceKernelGetProcessId())
+				sampleProcessMemory();
 		} else if(forceReset == 2) {
+			session_save(shell_pid, "main");
 			isShell = 0;
-			load_and_refresh();
+			reset_stats();
 			msg_time = curTime = fps_count = lateTime = forceReset = 0;
+			resume_cached = session_restore(current_pid, titleid) == 0;
+			if(!resume_cached)
+				load_and_refresh();
+			focus_changed();
+			if(resume_time) {
+				resume_us = (int)(ksceKernelGetProcessTimeWideCore() - resume_time);
+				resume_time = 0;
+			}
 		}
 	}
 	return ret;
 }
 
+// Counts the call, and for the focused title only tells whether the hook is bypassed.
+// The shell and every other process are always handled, the menu is driven from there.
+static int inputHook(int i) {
+	hook_hits[i]++;
+	if(isShell || current_pid != ksceKernelGetProcessId())
+		return 1;
+	hook_title_hits[i]++;
+	return hooks[i].active;
+}
+
 static tai_hook_ref_t ref_hook1;
 static int keys_patched1(int port, SceCtrlData *ctrl, int count) {
 	int ret, state;
-	if(isPspEmu) {
+	// never bypassed for the emulator, see below
+	if(!inputHook(HOOK_CTRL1) && !isPspEmu)
+		return TAI_CONTINUE(int, ref_hook1, port, ctrl, count);
+	// the emulator's polls pass straight through, other processes still go through
+	// checkButtons. While the menu is open the PSP game must not see the presses
+	// navigating it, so its buttons are cleared through a kernel side copy.
+	if(isPspEmu && current_pid == ksceKernelGetProcessId()) {
 		ENTER_SYSCALL(state);
 		ret = TAI_CONTINUE(int, ref_hook1, port, ctrl, count);
 		EXIT_SYSCALL(state);
+		if(showMenu) {
+			uint32_t none = 0;
+			for(int i = 0; i < ret; i++)
+				ksceKernelMemcpyKernelToUser((uintptr_t)&ctrl[i].buttons, &none, sizeof(none));
+		}
 	} else 
 		ret = checkButtons(port, ref_hook1, ctrl, count);
 	return ret;
@@ -362,36 +1692,50 @@ static int keys_patched1(int port, SceCtrlData *ctrl, int count) {
 
 static tai_hook_ref_t ref_hook2;
 static int keys_patched2(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL2))
+		return TAI_CONTINUE(int, ref_hook2, port, ctrl, count);
 	return checkButtons(port, ref_hook2, ctrl, count);
 }   
 
 static tai_hook_ref_t ref_hook3;
 static int keys_patched3(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL3))
+		return TAI_CONTINUE(int, ref_hook3, port, ctrl, count);
 	return checkButtons(port, ref_hook3, ctrl, count);
 }  
 
 static tai_hook_ref_t ref_hook4;
 static int keys_patched4(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL4))
+		return TAI_CONTINUE(int, ref_hook4, port, ctrl, count);
 	return checkButtons(port, ref_hook4, ctrl, count);
 }    
 
 static tai_hook_ref_t ref_hook5;
 static int keys_patched5(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL5))
+		return TAI_CONTINUE(int, ref_hook5, port, ctrl, count);
 	return checkButtons(port, ref_hook5, ctrl, count);
 }    
 
 static tai_hook_ref_t ref_hook6;
 static int keys_patched6(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL6))
+		return TAI_CONTINUE(int, ref_hook6, port, ctrl, count);
 	return checkButtons(port, ref_hook6, ctrl, count);
 }    
 
 static tai_hook_ref_t ref_hook7;
 static int keys_patched7(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL7))
+		return TAI_CONTINUE(int, ref_hook7, port, ctrl, count);
 	return checkButtons(port, ref_hook7, ctrl, count);
 }    
 
 static tai_hook_ref_t ref_hook8;
 static int keys_patched8(int port, SceCtrlData *ctrl, int count) {
+	if(!inputHook(HOOK_CTRL8))
+		return TAI_CONTINUE(int, ref_hook8, port, ctrl, count);
 	return checkButtons(port, ref_hook8, ctrl, count);
 }    
 
@@ -413,6 +1757,7 @@ void drawMenu() {
 			MENU_OPTION("Oclock Options");
 			MENU_OPTION("OSD Options");
 			MENU_OPTION("Ctrl Options");
+			MENU_OPTION("Perf Options");
 			MENU_OPTION("Exit Game");
 			MENU_OPTION("Suspend vita");
 			MENU_OPTION("Restart vita");
@@ -421,23 +1766,7 @@ void drawMenu() {
 		case 1:
 			blit_stringf(LEFT_LABEL_X, 88, "ACTUAL OVERCLOCK");		
 			blit_stringf(LEFT_LABEL_X, 120, "PROFILE    ");
-			switch(current_config.mode) {
-				case 4: 
-					blit_stringf(RIGHT_LABEL_X, 120, "Max Batt.");
-					break;
-				case 3: 
-					blit_stringf(RIGHT_LABEL_X, 120, "Holy Shit.");
-					break;
-				case 2: 
-					blit_stringf(RIGHT_LABEL_X, 120, "Max Perf.");
-					break;
-				case 1:
-					blit_stringf(RIGHT_LABEL_X, 120, "Game Def.");
-					break;
-				case 0:
-					blit_stringf(RIGHT_LABEL_X, 120, "Default  ");
-					break;
-				}	
+			blit_stringf(RIGHT_LABEL_X, 120, "%s", PROFILE_NAMES[current_config.mode]);
 			blit_stringf(LEFT_LABEL_X, 136, "CPU CLOCK  ");
 			blit_stringf(RIGHT_LABEL_X, 136, "%-4d  MHz - %d:%d", kscePowerGetArmClockFrequency(), *clock_r1, *clock_r2);
 			blit_stringf(LEFT_LABEL_X, 152, "BUS CLOCK  ");
@@ -451,17 +1780,153 @@ void drawMenu() {
 			blit_stringf(RIGHT_LABEL_X, 184, "%-4d  MHz", kscePowerGetGpuXbarClockFrequency());
 			blit_stringf(LEFT_LABEL_X, 200, "GPU CLOCK  ");
 			blit_stringf(RIGHT_LABEL_X, 200, "%-4d  MHz", kscePowerGetGpuClockFrequency());
+			blit_stringf(LEFT_LABEL_X, 216, "LAST RESUME");
+			blit_stringf(RIGHT_LABEL_X, 216, "%-6d us %s", resume_us, resume_cached ? "cached" : "disk");
+			blit_stringf(LEFT_LABEL_X, 232, "VALIDATOR  ");
+			if(validator_step >= 0)
+				blit_stringf(RIGHT_LABEL_X, 232, "step %d/%d", validator_step + 1, VALIDATOR_STEPS);
+			else if(validator_thid >= 0)
+				blit_stringf(RIGHT_LABEL_X, 232, "done, %d mismatches", validator_mismatches);
+			else
+				blit_stringf(RIGHT_LABEL_X, 232, isShell ? "X to start" : "from the shell only");
+			blit_stringf(LEFT_LABEL_X, 256, "RESIDENCY %s", res_titleid);
+			for(int d = 0; d < 5; d++) {
+				char line[64];
+				int len = 0;
+				uint32_t total = 0;
+				for(int i = 0; i < RES_FREQS; i++)
+					total += residency.bins[d][i].ms;
+				for(int i = 0; i < RES_FREQS && residency.bins[d][i].mhz && len < 40; i++)
+					len += snprintf(line + len, sizeof(line) - len, "%d:%d ", residency.bins[d][i].mhz, 
+						total ? (int)((uint64_t)residency.bins[d][i].ms * 100 / total) : 0);
+				line[len] = 0;
+				blit_stringf(LEFT_LABEL_X, 272+16*d, "%-11s", DOMAIN_NAMES[d]);
+				// the GPU setter is not hooked, so the title's own GPU requests are never seen
+				if(d == 4)
+					blit_stringf(RIGHT_LABEL_X, 272+16*d, "%sovr n/a", line);
+				else
+					blit_stringf(RIGHT_LABEL_X, 272+16*d, "%sovr %d/%d", line, residency.overridden[d], residency.requests[d]);
+			}
 			break;
 		case 2:
 			blit_stringf(LEFT_LABEL_X, 88, "OSD");	
 			MENU_OPTION_F("Show FPS %d",current_config.showFPS);
 			MENU_OPTION_F("Show Battery %d",current_config.showBat);
 			MENU_OPTION_F("Hide Errors %d",current_config.hideErrors);
+			MENU_OPTION_F("Show Memory %d",current_config.showMem);
 			break;
 		case 3:
 			blit_stringf(LEFT_LABEL_X, 88, "CONTROL");	
 			MENU_OPTION_F("BUTTON SWAP %d",current_config.buttonSwap);
+			for(int i = 0; i < 16; i++) {
+				MENU_OPTION_F("%-8s > %s", BUTTON_NAMES[i], 
+					current_config.remap[i] ? BUTTON_NAMES[current_config.remap[i] - 1] : "-");
+			}
+			blit_set_color(0x00FFFFFF, 0x00FF0000);
+			blit_stringf(LEFT_LABEL_X, 120+16*entries, "COST %d cyc/sample (%d)", 
+				remap_samples ? (int)(remap_cycles / remap_samples) : 0, (int)remap_samples);
 			break;			
+		case 4:
+			blit_stringf(LEFT_LABEL_X, 88, "PERFORMANCE");	
+			MENU_OPTION_F("FPS CAP %d",current_config.fpsCap);
+			MENU_OPTION_F("LOGGING %d",current_config.logging);
+			MENU_OPTION("Memory");
+			MENU_OPTION_F("LATENCY TEST %d",latencyMode);
+			MENU_OPTION("Latency");
+			MENU_OPTION_F("CAPTURE %d fps",captureRate);
+			MENU_OPTION("Hooks");
+			MENU_OPTION("Launch Times");
+			MENU_OPTION_F("THREAD BOOST %d",current_config.boost);
+			MENU_OPTION_F("IO STATS %d",current_config.ioStats);
+			MENU_OPTION("Storage");
+			blit_set_color(0x00FFFFFF, 0x00FF0000);
+			blit_stringf(LEFT_LABEL_X, 120+16*entries, "FRAME TIME ");
+			blit_stringf(RIGHT_LABEL_X, 120+16*entries, "%-6d us +-%d", frame_avg, frame_dev);
+			blit_stringf(LEFT_LABEL_X, 152+16*entries, "BOOST ON/OFF");
+			blit_stringf(RIGHT_LABEL_X, 152+16*entries, "%-6d us %d us", 
+				boost_frame_n[1] ? (int)(boost_frame_sum[1] / boost_frame_n[1]) : 0,
+				boost_frame_n[0] ? (int)(boost_frame_sum[0] / boost_frame_n[0]) : 0);
+			blit_stringf(LEFT_LABEL_X, 136+16*entries, "OSD DRAWS  ");
+			blit_stringf(RIGHT_LABEL_X, 136+16*entries, "%-6d skipped %d", osd_drawn, osd_skipped);
+			if(captureRate) {
+				unsigned int captured, dropped, copy_avg, copy_max;
+				capture_stats(&captured, &dropped, &copy_avg, &copy_max);
+				blit_stringf(LEFT_LABEL_X, 168+16*entries, "CAPTURED   ");
+				blit_stringf(RIGHT_LABEL_X, 168+16*entries, "%-6d dropped %d", captured, dropped);
+				blit_stringf(LEFT_LABEL_X, 184+16*entries, "CAPTURE COPY");
+				blit_stringf(RIGHT_LABEL_X, 184+16*entries, "%-6d us max %d", copy_avg, copy_max);
+			}
+			break;
+		case 5: {
+			blit_stringf(LEFT_LABEL_X, 88, "MEMORY     FREE / USED SINCE PEAK FREE");
+			blit_stringf(LEFT_LABEL_X, 120, "USER       ");
+			blit_stringf(RIGHT_LABEL_X, 120, "%-6d KB used %d KB", memFree(MEM_USER) >> 10, memUsed(MEM_USER) >> 10);
+			blit_stringf(LEFT_LABEL_X, 136, "CDRAM      ");
+			blit_stringf(RIGHT_LABEL_X, 136, "%-6d KB used %d KB", memFree(MEM_CDRAM) >> 10, memUsed(MEM_CDRAM) >> 10);
+			blit_stringf(LEFT_LABEL_X, 152, "PHYCONT    ");
+			blit_stringf(RIGHT_LABEL_X, 152, "%-6d KB used %d KB", memFree(MEM_PHYCONT) >> 10, memUsed(MEM_PHYCONT) >> 10);
+			// the kernel process's own budget, not kernel memory as a whole
+			blit_stringf(LEFT_LABEL_X, 184, "KPROC USER ");
+			if(mem_kern_ok)
+				blit_stringf(RIGHT_LABEL_X, 184, "%-6d KB free", mem_kern.size_user >> 10);
+			else
+				blit_stringf(RIGHT_LABEL_X, 184, "n/a");
+			blit_stringf(LEFT_LABEL_X, 200, "TREND      ");
+			blit_stringf(RIGHT_LABEL_X, 200, "%s (%d)", mem_growth >= MEM_GROWTH_SAMPLES ? "GROWING" : "stable", mem_growth);
+			}
+			break;
+		case 6:
+			blit_stringf(LEFT_LABEL_X, 88, "INPUT LATENCY %s", titleid);
+			for(int i = 0; i < 5; i++) {
+				latency_stats *stats = &lat_saved[i];
+				blit_stringf(LEFT_LABEL_X, 120+16*i, "%s", PROFILE_NAMES[i]);
+				if(stats->count)
+					blit_stringf(RIGHT_LABEL_X, 120+16*i, "n%-4d %3dms p50 %3d p90 %3d", stats->count, 
+						stats->sum / stats->count / 1000, latencyPercentile(stats, 50), latencyPercentile(stats, 90));
+				else
+					blit_stringf(RIGHT_LABEL_X, 120+16*i, "-");
+			}
+			break;
+		case 7:
+			blit_stringf(LEFT_LABEL_X, 88, "HOOKS");
+			for(int i = 0; i < HOOK_COUNT; i++) {
+				const char *status;
+				if(hooks[i].uid < 0)
+					status = "off";
+				else if(hooks[i].kind == HOOK_STATS)
+					status = current_config.ioStats ? "on" : "idle";
+				else
+					status = (hooks[i].kind != HOOK_INPUT || hooks[i].active) ? "on" : "off";
+				MENU_OPTION_F("%-12s %-4s %d", hooks[i].name, status, hook_title_hits[i] - hook_mark[i]);
+			}
+			break;
+		case 8:
+			blit_stringf(LEFT_LABEL_X, 88, "LAUNCH %s", launch_titleid);
+			blit_stringf(LEFT_LABEL_X, 104, "LAST       ");
+			blit_stringf(RIGHT_LABEL_X, 104, "id %d flip %d cont %d", launch_resolve, launch_flip, launch_content);
+			for(int i = 0; i < 5; i++) {
+				launch_stats *stats = &launch_data[i];
+				blit_stringf(LEFT_LABEL_X, 120+16*i, "%s", PROFILE_NAMES[i]);
+				if(stats->count)
+					blit_stringf(RIGHT_LABEL_X, 120+16*i, "n%-3d %5dms p90 %2ds", stats->count, 
+						stats->sum[2] / stats->count, histPercentile(stats->hist, LAUNCH_BUCKETS, stats->count, 90));
+				else
+					blit_stringf(RIGHT_LABEL_X, 120+16*i, "-");
+			}
+			break;
+		case 9:
+			blit_stringf(LEFT_LABEL_X, 88, "STORAGE %s", current_config.ioStats ? "" : "(IO STATS off)");
+			blit_stringf(LEFT_LABEL_X, 120, "READ       ");
+			blit_stringf(RIGHT_LABEL_X, 120, "%d.%02d MB/s", io_kbps[IO_READ] >> 10, (io_kbps[IO_READ] & 1023) * 100 >> 10);
+			blit_stringf(LEFT_LABEL_X, 136, "READ OPS/S ");
+			blit_stringf(RIGHT_LABEL_X, 136, "%-6d p99 %d us", io_ops[IO_READ], io_p99[IO_READ]);
+			blit_stringf(LEFT_LABEL_X, 152, "WRITE      ");
+			blit_stringf(RIGHT_LABEL_X, 152, "%d.%02d MB/s", io_kbps[IO_WRITE] >> 10, (io_kbps[IO_WRITE] & 1023) * 100 >> 10);
+			blit_stringf(LEFT_LABEL_X, 168, "WRITE OPS/S");
+			blit_stringf(RIGHT_LABEL_X, 168, "%-6d p99 %d us", io_ops[IO_WRITE], io_p99[IO_WRITE]);
+			blit_stringf(LEFT_LABEL_X, 184, "COVERS     ");
+			blit_stringf(RIGHT_LABEL_X, 184, "sceIoRead/Write, not Pread or async");
+			break;
 	}
 	if(pos >= entries)
 		pos = entries -1;	
@@ -469,7 +1934,8 @@ void drawMenu() {
 
 static tai_hook_ref_t ref_hook0;
 int _sceDisplaySetFrameBufInternalForDriver(int fb_id1, int fb_id2, const SceDisplayFrameBuf *pParam, int sync){
-	if(!isPspEmu && fb_id1 && pParam) {
+	hook_hits[HOOK_DISPLAY]++;
+	if(fb_id1 && pParam) {
 		if(!shell_pid && fb_id2) {//3.68 fix
 			if(ksceKernelGetProcessTitleId(ksceKernelGetProcessId(), titleid, sizeof(titleid))==0 && titleid[0] != 0) {
 				if(strncmp("main",titleid, sizeof(titleid))==0) {
@@ -482,14 +1948,28 @@ int _sceDisplaySetFrameBufInternalForDriver(int fb_id1, int fb_id2, const SceDis
 		memset(&kfb,0,sizeof(kfb));
 		memcpy(&kfb, pParam, sizeof(SceDisplayFrameBuf));
 		blit_set_frame_buf(&kfb);
+		if(latencyMode && !isShell && current_pid == ksceKernelGetProcessId())
+			latencyFlip(&kfb);
+		if(captureRate && !isShell && current_pid == ksceKernelGetProcessId())
+			doCapture(&kfb);
+		if(launch_start && !launch_content && launch_pid == ksceKernelGetProcessId())
+			launchFlip(&kfb);
 		if(showMenu) drawMenu();
 		
 		blit_set_color(0x0000FF00, 0xff000000);
 		if((isShell && shell_pid == ksceKernelGetProcessId())||(!isShell && current_pid == ksceKernelGetProcessId())) {
-			drawErrors();
+			int draw = needsOverlay(&kfb), repeat = isRepeatFlip(&kfb);
+			if(draw) drawErrors();
 			curTime = ksceKernelGetProcessTimeWideCore();
-			if(current_config.showFPS) doFps();
-			if(current_config.showBat) blit_stringf(20, 30, "%02d\%", kscePowerGetBatteryLifePercent());
+			if(current_config.showFPS) doFps(draw, !repeat);
+			if(draw && current_config.showBat) blit_stringf(20, 30, "%02d\%", kscePowerGetBatteryLifePercent());
+			if(draw && current_config.showMem) drawMem(45);
+			if(!repeat) {
+				doFrameLimit(sync);
+				doFrameStats();
+			}
+			flip_base = kfb.base;
+			flip_vcount = ksceDisplayGetVcount();
 		}
 		
 	}
@@ -514,8 +1994,31 @@ int getFindModNameFromPID(int pid, char *mod_name, int size) {
 	return ret;
 }
 
+static tai_hook_ref_t io_hook_read;
+static int io_read_patched(SceUID fd, void *data, SceSize size) {
+	hook_hits[HOOK_IO_READ]++;
+	if(isShell || !current_config.ioStats || current_pid != ksceKernelGetProcessId())
+		return TAI_CONTINUE(int, io_hook_read, fd, data, size);
+	uint64_t start = ksceKernelGetProcessTimeWideCore();
+	int ret = TAI_CONTINUE(int, io_hook_read, fd, data, size);
+	io_account(IO_READ, ret, ksceKernelGetProcessTimeWideCore() - start);
+	return ret;
+}
+
+static tai_hook_ref_t io_hook_write;
+static int io_write_patched(SceUID fd, const void *data, SceSize size) {
+	hook_hits[HOOK_IO_WRITE]++;
+	if(isShell || !current_config.ioStats || current_pid != ksceKernelGetProcessId())
+		return TAI_CONTINUE(int, io_hook_write, fd, data, size);
+	uint64_t start = ksceKernelGetProcessTimeWideCore();
+	int ret = TAI_CONTINUE(int, io_hook_write, fd, data, size);
+	io_account(IO_WRITE, ret, ksceKernelGetProcessTimeWideCore() - start);
+	return ret;
+}
+
 static tai_hook_ref_t process_hook0;
 int SceProcEventForDriver_414CC813(int pid, int id, int r3, int r4, int r5, int r6){
+	hook_hits[HOOK_PROCESS]++;
 	SceKernelProcessInfo info;
 	info.size = 0xE8;
 	char module_name[28];
@@ -531,31 +2034,127 @@ int SceProcEventForDriver_414CC813(int pid, int id, int r3, int r4, int r5, int
 					}
 				}
 			case 0x5:
+				resume_time = id == 0x5 ? ksceKernelGetProcessTimeWideCore() : 0;
+				if(id == 0x1)
+					launchStart(pid);
 				isPspEmu = getFindModNameFromPID(pid, "adrenaline", sizeof("adrenaline"))||getFindModNameFromPID(pid, "ScePspemu", sizeof("ScePspemu"));
 				current_pid = pid;
 				if(!isPspEmu) 
 					forceReset = 1;
 				 else {
 					ksceKernelGetProcessTitleId(pid, titleid, sizeof(titleid));
-					showMenu = isShell = current_config.mode = 0;
+					showMenu = isShell = 0;
+					session_save(shell_pid, "main");
+					reset_stats();
+					load_and_refresh();
+					focus_changed();
 				}
 				break;
 		}
 	} else {
 		if((id==0x4 || id == 0x3)&& (current_pid==pid||isPspEmu)) {
+			if(!isPspEmu)
+				session_save(pid, titleid);
 			msg_time = curTime = fps_count = lateTime = 0;
+			reset_stats();
 			isShell = 1;
 			strncpy(titleid, "main", sizeof("main"));
 			isPspEmu =0;
-			load_and_refresh();
+			if(session_restore(shell_pid, titleid) < 0)
+				load_and_refresh();
+			focus_changed();
 		}
 	}
 	return TAI_CONTINUE(int, process_hook0, pid, id, r3, r4, r5, r6);
 }
 
+#define HOOK(NAME, TYPE, MODULE, LIBRARY, NID, HANDLER, REF, KIND) {NAME, TYPE, MODULE, LIBRARY, NID, HANDLER, &REF, KIND, 1, -1}
+static hook_entry hooks[HOOK_COUNT] = {
+	HOOK("Display",     HOOK_TYPE_EXPORT, "SceDisplay", 0x9FED47AC, 0x16466675, _sceDisplaySetFrameBufInternalForDriver, ref_hook0, HOOK_CORE),
+	HOOK("PeekPos",     HOOK_TYPE_EXPORT, "SceCtrl", TAI_ANY_LIBRARY, 0xEA1D3A34, keys_patched1, ref_hook1, HOOK_INPUT), // sceCtrlPeekBufferPositive
+	HOOK("PeekPos2",    HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x3EF8, keys_patched2, ref_hook2, HOOK_INPUT), // sceCtrlPeekBufferPositive2
+	HOOK("ReadPos",     HOOK_TYPE_EXPORT, "SceCtrl", TAI_ANY_LIBRARY, 0x9B96A1AA, keys_patched3, ref_hook3, HOOK_INPUT), // sceCtrlReadBufferPositive
+	HOOK("ReadPosExt2", HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x4E14, keys_patched4, ref_hook4, HOOK_INPUT), // sceCtrlReadBufferPositiveExt2
+	HOOK("PeekPosExt2", HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x4B48, keys_patched5, ref_hook5, HOOK_INPUT), // sceCtrlPeekBufferPositiveExt2
+	HOOK("PeekPosExt",  HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x3928, keys_patched6, ref_hook6, HOOK_INPUT), // sceCtrlPeekBufferPositiveExt
+	HOOK("ReadPos2",    HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x449C, keys_patched7, ref_hook7, HOOK_INPUT), // sceCtrlReadBufferPositive2
+	HOOK("ReadPosExt",  HOOK_TYPE_OFFSET, "SceCtrl", 0, 0x3BCC, keys_patched8, ref_hook8, HOOK_INPUT), // sceCtrlReadBufferPositiveExt
+	HOOK("ProcEvent",   HOOK_TYPE_IMPORT, "SceProcessmgr", TAI_ANY_LIBRARY, 0x414CC813, SceProcEventForDriver_414CC813, process_hook0, HOOK_CORE),
+	HOOK("ArmClock",    HOOK_TYPE_EXPORT, "ScePower", 0x1590166F, 0x74DB5AE5, power_patched1, power_hook1, HOOK_CORE), // scePowerSetArmClockFrequency
+	HOOK("BusClock",    HOOK_TYPE_EXPORT, "ScePower", 0x1590166F, 0xB8D7B3FB, power_patched2, power_hook2, HOOK_CORE), // scePowerSetBusClockFrequency
+	HOOK("GpuClock",    HOOK_TYPE_EXPORT, "ScePower", 0x1590166F, 0x264C24FC, power_patched3, power_hook3, HOOK_CORE), // scePowerSetGpuClockFrequency
+	HOOK("XbarClock",   HOOK_TYPE_EXPORT, "ScePower", 0x1590166F, 0xA7739DBE, power_patched4, power_hook4, HOOK_CORE), // scePowerSetGpuXbarClockFrequency
+	HOOK("IoRead",      HOOK_TYPE_EXPORT, "SceIofilemgr", TAI_ANY_LIBRARY, 0xFDB32293, io_read_patched, io_hook_read, HOOK_STATS), // sceIoRead
+	HOOK("IoWrite",     HOOK_TYPE_EXPORT, "SceIofilemgr", TAI_ANY_LIBRARY, 0x34EFD876, io_write_patched, io_hook_write, HOOK_STATS), // sceIoWrite
+};
+
+int hook_install(int i) {
+	hook_entry *hook = &hooks[i];
+	tai_module_info_t tai_info;
+	switch(hook->type) {
+		case HOOK_TYPE_EXPORT:
+			hook->uid = taiHookFunctionExportForKernel(KERNEL_PID, hook->ref, hook->module, hook->library_nid, hook->nid, hook->handler);
+			break;
+		case HOOK_TYPE_IMPORT:
+			hook->uid = taiHookFunctionImportForKernel(KERNEL_PID, hook->ref, hook->module, hook->library_nid, hook->nid, hook->handler);
+			break;
+		case HOOK_TYPE_OFFSET:
+			tai_info.size = sizeof(tai_module_info_t);
+			hook->uid = taiGetModuleInfoForKernel(KERNEL_PID, hook->module, &tai_info);
+			if(hook->uid >= 0)
+				hook->uid = taiHookFunctionOffsetForKernel(KERNEL_PID, hook->ref, tai_info.modid, 0, hook->nid, 1, hook->handler);
+			break;
+	}
+	return hook->uid;
+}
+
+void hook_release(int i) {
+	// the ref is left alone, a thread may still be on its way into TAI_CONTINUE
+	if(hooks[i].uid >= 0)
+		taiHookReleaseForKernel(hooks[i].uid, *hooks[i].ref);
+	hooks[i].uid = -1;
+}
+
+// Runs on the sampler thread after a focus change, never from inside a hook.
+// Input hooks stay installed, only their per title flag changes.
+void hooks_apply() {
+	for(int i = 0; i < HOOK_COUNT; i++) {
+		switch(hooks[i].kind) {
+			case HOOK_INPUT:
+				hooks[i].active = !(current_config.hooksOff & (1 << i));
+				break;
+			case HOOK_STATS:
+				// installed once and kept, the handlers check ioStats themselves
+				if(current_config.ioStats && hooks[i].uid < 0)
+					hook_install(i);
+				break;
+		}
+		hook_mark[i] = hook_title_hits[i];
+	}
+}
+
+// The cycle counter used to time the remap loop is per core, so start it once on each
+// core here rather than from the input hooks
+static int pmu_thread(SceSize args, void *argp) {
+	pmu_enable();
+	return 0;
+}
+
+void pmu_enable_all() {
+	for(int core = 0; core < 4; core++) {
+		SceUID thid = ksceKernelCreateThread("LOLIcon_pmu", pmu_thread, 0x3C, 0x1000, 0, 0x10000 << core, NULL);
+		if(thid < 0)
+			continue;
+		ksceKernelStartThread(thid, 0, NULL);
+		ksceKernelWaitThreadEnd(thid, NULL, NULL);
+		ksceKernelDeleteThread(thid);
+	}
+}
+
 void _start() __attribute__ ((weak, alias ("module_start")));
 int module_start(SceSize argc, const void *args) {
 	ksceIoMkdir(CONFIG_PATH,6);
+	pmu_enable_all();
 	module_get_export_func(KERNEL_PID, "ScePower", 0x1590166F, 0x475BCC82, &_kscePowerGetGpuEs4ClockFrequency);
 	module_get_export_func(KERNEL_PID, "ScePower", 0x1590166F, 0x264C24FC, &_kscePowerSetGpuEs4ClockFrequency);
 	module_get_export_func(KERNEL_PID, "ScePower", 0x1590166F, 0x64641E6A, &_kscePowerGetGpuClockFrequency);
@@ -577,6 +2176,7 @@ int module_start(SceSize argc, const void *args) {
 	
 	current_config.mode = 3;
 	
+	res_mutex = ksceKernelCreateMutex("LOLIcon_residency", 0, 0, NULL);
 	refreshClocks();
 	
 	if(module_get_export_func(KERNEL_PID, "SceKernelModulemgr", 0xC445FA63, 0xD269F915 , &_ksceKernelGetModuleInfo))
@@ -585,48 +2185,48 @@ int module_start(SceSize argc, const void *args) {
 		module_get_export_func(KERNEL_PID, "SceKernelModulemgr", 0x92C9FFC2, 0xB72C75A4 , &_ksceKernelGetModuleList);
 	if(module_get_export_func(KERNEL_PID, "SceProcessmgr", 0x7A69DE86, 0x4CA7DC42 , &_ksceKernelExitProcess))
 		module_get_export_func(KERNEL_PID, "SceProcessmgr", 0xEB1F8EF7, 0x905621F9 , &_ksceKernelExitProcess);
+	module_get_export_func(KERNEL_PID, "SceSysmem", TAI_ANY_LIBRARY, 0x87CC580C , &_ksceKernelGetFreeMemorySize); // sceKernelGetFreeMemorySize
+	module_get_export_func(KERNEL_PID, "SceKernelThreadMgr", TAI_ANY_LIBRARY, 0xEA7B8AEF , &_ksceKernelGetThreadIdList); // SceThreadmgrForKernel
 
 	
-	g_hooks[0] = taiHookFunctionExportForKernel(KERNEL_PID, &ref_hook0, "SceDisplay",0x9FED47AC,0x16466675, _sceDisplaySetFrameBufInternalForDriver); 
-	
-	
-	g_hooks[10] = taiHookFunctionExportForKernel(KERNEL_PID, &power_hook1, "ScePower", 0x1590166F, 0x74DB5AE5,power_patched1); // scePowerSetArmClockFrequency
-	g_hooks[11] = taiHookFunctionExportForKernel(KERNEL_PID,	&power_hook2, "ScePower", 0x1590166F, 0xB8D7B3FB, power_patched2); // scePowerSetBusClockFrequency
-	g_hooks[12] = taiHookFunctionExportForKernel(KERNEL_PID, &power_hook3, "ScePower", 0x1590166F, 0x264C24FC, power_patched3); // scePowerSetGpuClockFrequency
-	g_hooks[13] = taiHookFunctionExportForKernel(KERNEL_PID, &power_hook4, "ScePower", 0x1590166F, 0xA7739DBE, power_patched4); // scePowerSetGpuXbarClockFrequency
-	
-	taiGetModuleInfoForKernel(KERNEL_PID, "SceCtrl", &tai_info);
-	g_hooks[1] = taiHookFunctionExportForKernel(KERNEL_PID, &ref_hook1, "SceCtrl", TAI_ANY_LIBRARY, 0xEA1D3A34, keys_patched1); // sceCtrlPeekBufferPositive
-	g_hooks[2] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook2, tai_info.modid, 0, 0x3EF8, 1, keys_patched2); // sceCtrlPeekBufferPositive2
-	g_hooks[3] = taiHookFunctionExportForKernel(KERNEL_PID, &ref_hook3, "SceCtrl", TAI_ANY_LIBRARY, 0x9B96A1AA, keys_patched3); // sceCtrlReadBufferPositive
-	g_hooks[4] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook4, tai_info.modid, 0, 0x4E14, 1, keys_patched4); // sceCtrlReadBufferPositiveExt2
-	g_hooks[5] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook5, tai_info.modid, 0, 0x4B48, 1, keys_patched5); // sceCtrlPeekBufferPositiveExt2
-	g_hooks[6] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook6, tai_info.modid, 0, 0x3928, 1, keys_patched6); // sceCtrlPeekBufferPositiveExt
-    g_hooks[7] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook7, tai_info.modid, 0, 0x449C, 1, keys_patched7); // sceCtrlReadBufferPositive2
-    g_hooks[8] =  taiHookFunctionOffsetForKernel(KERNEL_PID, &ref_hook8, tai_info.modid, 0, 0x3BCC, 1, keys_patched8); // sceCtrlReadBufferPositiveExt
-		  
-	g_hooks[9] = taiHookFunctionImportForKernel(KERNEL_PID, &process_hook0, "SceProcessmgr", TAI_ANY_LIBRARY, 0x414CC813, SceProcEventForDriver_414CC813); 
+	for(int i = 0; i < HOOK_COUNT; i++)
+		if(hooks[i].kind != HOOK_STATS)
+			hook_install(i);
 		
+	sampler_run = 1;
+	sampler_sema = ksceKernelCreateSema("LOLIcon_sampler", 0, 0, 1, NULL);
+	sampler_thid = ksceKernelCreateThread("LOLIcon_sampler", sampler_thread, 0x3C, 0x4000, 0, 0, NULL);
+	if(sampler_thid >= 0)
+		ksceKernelStartThread(sampler_thid, 0, NULL);
+	
 	
 	return SCE_KERNEL_START_SUCCESS;
 }
 
 int module_stop(SceSize argc, const void *args) {
+	capture_stop();
+	if(validator_thid >= 0) {
+		ksceKernelWaitThreadEnd(validator_thid, NULL, NULL);
+		ksceKernelDeleteThread(validator_thid);
+	}
+	if(sampler_thid >= 0) {
+		sampler_run = 0;
+		if(sampler_sema >= 0)
+			ksceKernelSignalSema(sampler_sema, 1);
+		ksceKernelWaitThreadEnd(sampler_thid, NULL, NULL);
+		ksceKernelDeleteThread(sampler_thid);
+	}
+	if(sampler_sema >= 0)
+		ksceKernelDeleteSema(sampler_sema);
+	res_saved = 0; // flush residency gathered since the last periodic save
+	if(res_mutex >= 0)
+		residency_sync();
+
 	// free hooks that didn't fail
-	if (g_hooks[0] >= 0) taiHookReleaseForKernel(g_hooks[0], ref_hook0);
-	if (g_hooks[1] >= 0) taiHookReleaseForKernel(g_hooks[1], ref_hook1);
-	if (g_hooks[2] >= 0) taiHookReleaseForKernel(g_hooks[2], ref_hook2);
-	if (g_hooks[3] >= 0) taiHookReleaseForKernel(g_hooks[3], ref_hook3);
-	if (g_hooks[4] >= 0) taiHookReleaseForKernel(g_hooks[4], ref_hook4);
-	if (g_hooks[5] >= 0) taiHookReleaseForKernel(g_hooks[5], ref_hook5);
-	if (g_hooks[6] >= 0) taiHookReleaseForKernel(g_hooks[6], ref_hook6);
-	if (g_hooks[7] >= 0) taiHookReleaseForKernel(g_hooks[7], ref_hook7);
-	if (g_hooks[8] >= 0) taiHookReleaseForKernel(g_hooks[8], ref_hook8);
-	if (g_hooks[9] >= 0) taiHookReleaseForKernel(g_hooks[9], process_hook0);
-	if (g_hooks[10] >= 0) taiHookReleaseForKernel(g_hooks[10], power_hook1);
-	if (g_hooks[11] >= 0) taiHookReleaseForKernel(g_hooks[11], power_hook2);
-	if (g_hooks[12] >= 0) taiHookReleaseForKernel(g_hooks[12], power_hook3);
-	if (g_hooks[13] >= 0) taiHookReleaseForKernel(g_hooks[13], power_hook4);
+	for(int i = 0; i < HOOK_COUNT; i++)
+		hook_release(i);
+	if(res_mutex >= 0)
+		ksceKernelDeleteMutex(res_mutex);
 
 	return SCE_KERNEL_STOP_SUCCESS;
 }
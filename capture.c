@@ -0,0 +1,315 @@
+/*
+	Streaming frame capture
+
+	The display hook copies every fourth line of the frame through a line buffer,
+	keeping every fourth pixel, into one of a few preallocated slots and returns;
+	it never allocates, waits or touches storage, and the time it takes is kept.
+	A low priority thread XORs the frame against the previous one and run-length
+	encodes the result into ur0:LOLIcon/<titleid>/capture.rle. When every slot
+	is still busy the frame is counted as dropped instead.
+
+	Stream layout, per frame: capture_header followed by packets of a uint16
+	count and 32-bit words. Counts with the top bit set repeat the single word
+	that follows, otherwise that many literal words follow. Decoded words are
+	XORed onto the previous frame, or onto zeros when the header has
+	CAPTURE_KEYFRAME set. That is the case for the first frame written since
+	the file was opened, which is appended to across capture sessions, and
+	whenever the frame size changes.
+*/
+#include <libk/string.h>
+#include <libk/stdio.h>
+#include <sys/syslimits.h>
+
+#include "capture.h"
+
+#define CAPTURE_PATH   "ur0:LOLIcon/"
+#define CAPTURE_MAGIC  0x5041434C // "LCAP"
+#define CAPTURE_SLOTS  3
+#define MAX_WIDTH      960
+#define MAX_HEIGHT     544
+#define CAPTURE_SCALE  4
+#define SLOT_SIZE      0x20000 // (MAX_WIDTH / 4) * (MAX_HEIGHT / 4) pixels, in bytes
+#define PREV_SIZE      SLOT_SIZE
+#define OUT_SIZE       0x10000
+
+#define SLOT_FREE      0
+#define SLOT_COPYING   1
+#define SLOT_FILLED    2
+
+typedef struct capture_header {
+	uint32_t magic;
+	uint32_t index;
+	uint64_t time;
+	uint16_t width;
+	uint16_t height;
+	uint32_t dropped;
+	uint32_t flags;
+} capture_header;
+#define CAPTURE_KEYFRAME 0x1 // XORed against zeros, not the previous frame
+
+typedef struct capture_slot {
+	volatile int state;
+	uint64_t time;
+	int width, height;
+	char titleid[32];
+	SceUID block;
+	uint32_t *pixels;
+	uint32_t line[MAX_WIDTH];
+} capture_slot;
+
+static capture_slot slots[CAPTURE_SLOTS];
+static SceUID prev_block = -1, out_block = -1, capture_sema = -1, capture_thid = -1;
+static uint32_t *prev;
+static uint8_t *out;
+static int out_len, capture_run = 0, next_slot = 0;
+static volatile int capture_inflight = 0; // display hook calls inside capture_frame
+static unsigned int captured = 0, dropped = 0, copies = 0, copy_us = 0, copy_max = 0;
+static SceUID fd = -1;
+static char fd_titleid[32];
+static int prev_width = 0, prev_height = 0; // size of the frame in prev, 0 when prev was reset
+
+static void *alloc_block(const char *name, int size, SceUID *uid)
+{
+	void *base = NULL;
+	*uid = ksceKernelAllocMemBlock(name, SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, size, NULL);
+	if(*uid < 0)
+		return NULL;
+	ksceKernelGetMemBlockBase(*uid, &base);
+	return base;
+}
+
+static void free_blocks()
+{
+	for(int i = 0; i < CAPTURE_SLOTS; i++) {
+		if(slots[i].block >= 0)
+			ksceKernelFreeMemBlock(slots[i].block);
+		slots[i].block = -1;
+	}
+	if(prev_block >= 0)
+		ksceKernelFreeMemBlock(prev_block);
+	if(out_block >= 0)
+		ksceKernelFreeMemBlock(out_block);
+	prev_block = out_block = -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// encoder, only ever runs on the capture thread
+/////////////////////////////////////////////////////////////////////////////
+static void flush()
+{
+	if(fd >= 0 && out_len)
+		ksceIoWrite(fd, out, out_len);
+	out_len = 0;
+}
+
+static void put(const void *data, int size)
+{
+	if(out_len + size > OUT_SIZE)
+		flush();
+	memcpy(out + out_len, data, size);
+	out_len += size;
+}
+
+static void encode(const uint32_t *in, int n)
+{
+	int i = 0;
+	while(i < n) {
+		int run = 1;
+		while(i + run < n && run < 0x7FFF && in[i + run] == in[i])
+			run++;
+		if(run >= 3) {
+			uint16_t count = 0x8000 | run;
+			put(&count, sizeof(count));
+			put(&in[i], sizeof(uint32_t));
+			i += run;
+		} else {
+			int start = i;
+			while(i < n && i - start < 0x7FFF) {
+				if(i + 2 < n && in[i] == in[i + 1] && in[i] == in[i + 2])
+					break;
+				i++;
+			}
+			uint16_t count = i - start;
+			put(&count, sizeof(count));
+			put(&in[start], count * sizeof(uint32_t));
+		}
+	}
+}
+
+static void open_stream(const char *titleid)
+{
+	char path[PATH_MAX];
+	if(fd >= 0 && strncmp(fd_titleid, titleid, sizeof(fd_titleid)) == 0)
+		return;
+	flush();
+	if(fd >= 0)
+		ksceIoClose(fd);
+	memset(prev, 0, PREV_SIZE);
+	prev_width = prev_height = 0;
+	strncpy(fd_titleid, titleid, sizeof(fd_titleid));
+	snprintf(path, sizeof(path), CAPTURE_PATH"%s", titleid);
+	ksceIoMkdir(path, 6);
+	snprintf(path, sizeof(path), CAPTURE_PATH"%s/capture.rle", titleid);
+	fd = ksceIoOpen(path, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 0777);
+}
+
+static void write_slot(capture_slot *slot)
+{
+	int width = slot->width, height = slot->height;
+	uint32_t *pixels = slot->pixels;
+	capture_header header;
+
+	open_stream(slot->titleid);
+	if(width != prev_width || height != prev_height) {
+		memset(prev, 0, PREV_SIZE);
+		header.flags = CAPTURE_KEYFRAME;
+	} else
+		header.flags = 0;
+	prev_width = width;
+	prev_height = height;
+
+	// keep only what changed
+	for(int i = 0; i < width * height; i++) {
+		uint32_t pixel = pixels[i];
+		pixels[i] ^= prev[i];
+		prev[i] = pixel;
+	}
+
+	header.magic = CAPTURE_MAGIC;
+	header.index = captured;
+	header.time = slot->time;
+	header.width = width;
+	header.height = height;
+	header.dropped = dropped;
+	put(&header, sizeof(header));
+	encode(pixels, width * height);
+	flush();
+	captured++;
+}
+
+static int capture_thread(SceSize args, void *argp)
+{
+	int i = 0;
+	while(1) {
+		ksceKernelWaitSema(capture_sema, 1, NULL);
+		if(!capture_run)
+			break;
+		// slots are filled round robin, so drain them in the same order
+		while(slots[i].state == SLOT_FILLED) {
+			write_slot(&slots[i]);
+			slots[i].state = SLOT_FREE;
+			i = (i + 1) % CAPTURE_SLOTS;
+		}
+	}
+	flush();
+	if(fd >= 0)
+		ksceIoClose(fd);
+	fd = -1;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// public
+/////////////////////////////////////////////////////////////////////////////
+int capture_start()
+{
+	if(capture_run)
+		return 0;
+	for(int i = 0; i < CAPTURE_SLOTS; i++) {
+		slots[i].state = SLOT_FREE;
+		slots[i].pixels = alloc_block("LOLIcon_capture", SLOT_SIZE, &slots[i].block);
+	}
+	prev = alloc_block("LOLIcon_capture_prev", PREV_SIZE, &prev_block);
+	out = alloc_block("LOLIcon_capture_out", OUT_SIZE, &out_block);
+	for(int i = 0; i < CAPTURE_SLOTS; i++)
+		if(!slots[i].pixels)
+			prev = NULL;
+	if(!prev || !out) {
+		free_blocks();
+		return -1;
+	}
+	out_len = next_slot = 0;
+	captured = dropped = copies = copy_us = copy_max = 0;
+	fd_titleid[0] = 0;
+	capture_sema = ksceKernelCreateSema("LOLIcon_capture", 0, 0, CAPTURE_SLOTS, NULL);
+	capture_thid = ksceKernelCreateThread("LOLIcon_capture", capture_thread, 0xA0, 0x2000, 0, 0, NULL);
+	if(capture_sema < 0 || capture_thid < 0) {
+		if(capture_sema >= 0)
+			ksceKernelDeleteSema(capture_sema);
+		if(capture_thid >= 0)
+			ksceKernelDeleteThread(capture_thid);
+		capture_sema = capture_thid = -1;
+		free_blocks();
+		return -1;
+	}
+	capture_run = 1;
+	ksceKernelStartThread(capture_thid, 0, NULL);
+	return 0;
+}
+
+void capture_stop()
+{
+	if(!capture_run)
+		return;
+	capture_run = 0;
+	__sync_synchronize();
+	while(capture_inflight)
+		ksceKernelDelayThread(1000);
+	ksceKernelSignalSema(capture_sema, 1);
+	ksceKernelWaitThreadEnd(capture_thid, NULL, NULL);
+	ksceKernelDeleteThread(capture_thid);
+	ksceKernelDeleteSema(capture_sema);
+	capture_thid = capture_sema = -1;
+	free_blocks();
+}
+
+// Called from the display hook, possibly from several threads at once: copy a
+// downscaled frame and hand it off, or count a drop
+int capture_frame(const SceDisplayFrameBuf *param, const char *titleid)
+{
+	int ret = -1;
+	__sync_fetch_and_add(&capture_inflight, 1);
+	if(!capture_run || param->pixelformat != 0 || param->width > MAX_WIDTH || param->height > MAX_HEIGHT)
+		goto out;
+	int index = next_slot;
+	capture_slot *slot = &slots[index];
+	if(!__sync_bool_compare_and_swap(&slot->state, SLOT_FREE, SLOT_COPYING)) {
+		__sync_fetch_and_add(&dropped, 1);
+		goto out;
+	}
+	next_slot = (index + 1) % CAPTURE_SLOTS;
+
+	uint64_t start = ksceKernelGetSystemTimeWide();
+	int width = param->width / CAPTURE_SCALE, height = param->height / CAPTURE_SCALE;
+	for(int y = 0; y < height; y++) {
+		ksceKernelMemcpyUserToKernel(slot->line,
+			(uintptr_t)((uint32_t *)param->base + y * CAPTURE_SCALE * param->pitch), param->width * 4);
+		for(int x = 0; x < width; x++)
+			slot->pixels[y * width + x] = slot->line[x * CAPTURE_SCALE];
+	}
+	slot->time = ksceKernelGetSystemTimeWide();
+	unsigned int us = slot->time - start;
+	__sync_fetch_and_add(&copy_us, us);
+	__sync_fetch_and_add(&copies, 1);
+	if(us > copy_max)
+		copy_max = us;
+
+	slot->width = width;
+	slot->height = height;
+	strncpy(slot->titleid, titleid, sizeof(slot->titleid));
+	__sync_synchronize();
+	slot->state = SLOT_FILLED;
+	ksceKernelSignalSema(capture_sema, 1);
+	ret = 0;
+out:
+	__sync_fetch_and_sub(&capture_inflight, 1);
+	return ret;
+}
+
+void capture_stats(unsigned int *c, unsigned int *d, unsigned int *avg_us, unsigned int *max_us)
+{
+	*c = captured;
+	*d = dropped;
+	*avg_us = copies ? copy_us / copies : 0;
+	*max_us = copy_max;
+}
@@ -0,0 +1,11 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <vitasdkkern.h>
+
+int capture_start(void);
+void capture_stop(void);
+int capture_frame(const SceDisplayFrameBuf *param, const char *titleid);
+void capture_stats(unsigned int *captured, unsigned int *dropped, unsigned int *copy_avg_us, unsigned int *copy_max_us);
+
+#endif
@@ -20,6 +20,15 @@ int WriteFile(const char *file, void *buf, int size) {
 	return written;
 }
 
+int AppendFile(const char *file, void *buf, int size) {
+	SceUID fd = ksceIoOpen(file, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 0777);
+	if (fd < 0)
+	return fd;
+	int written = ksceIoWrite(fd, buf, size);
+	ksceIoClose(fd);
+	return written;
+}
+
 unsigned int pa2va(unsigned int pa) {
 	unsigned int va;
 	unsigned int vaddr;
@@ -36,4 +45,35 @@ unsigned int pa2va(unsigned int pa) {
 		}
 	}
 	return va;
+}
+
+// Cycle counter of the core we are running on, see pmu_enable
+unsigned int pmu_cycles() {
+	unsigned int cycles;
+	__asm__ volatile("mrc p15,0,%0,c9,c13,0" : "=r" (cycles));
+	return cycles;
+}
+
+// Whether this core's cycle counter is counting
+int pmu_running() {
+	unsigned int pmcr, enabled;
+	__asm__ volatile("mrc p15,0,%0,c9,c12,0" : "=r" (pmcr));
+	__asm__ volatile("mrc p15,0,%0,c9,c12,1" : "=r" (enabled));
+	return (pmcr & 1) && (enabled & 0x80000000);
+}
+
+// Start this core's cycle counter without resetting anything another user set up
+void pmu_enable() {
+	unsigned int pmcr;
+	__asm__ volatile("mrc p15,0,%0,c9,c12,0" : "=r" (pmcr));
+	if (!(pmcr & 1))
+		__asm__ volatile("mcr p15,0,%0,c9,c12,0" :: "r" (pmcr | 1));
+	__asm__ volatile("mcr p15,0,%0,c9,c12,1" :: "r" (0x80000000));
+}
+
+// Index of the core we are running on
+int cpu_id() {
+	unsigned int mpidr;
+	__asm__ volatile("mrc p15,0,%0,c0,c0,5" : "=r" (mpidr));
+	return mpidr & 3;
 }
\ No newline at end of file
@@ -1,3 +1,8 @@
 unsigned int pa2va(unsigned int pa);
 int WriteFile(const char *file, void *buf, int size);
-int ReadFile(const char *file, void *buf, int size);
\ No newline at end of file
+int ReadFile(const char *file, void *buf, int size);
+int AppendFile(const char *file, void *buf, int size);
+unsigned int pmu_cycles();
+int pmu_running();
+void pmu_enable();
+int cpu_id();
\ No newline at end of file